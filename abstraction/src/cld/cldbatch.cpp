@@ -0,0 +1,196 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <opencv2/highgui/highgui.hpp>
+
+#include "cldbatch.h"
+
+// Files a directory input is filtered to, compared in lower case.
+static const char* imageExtensions[] = { ".jpg", ".jpeg", ".png", ".bmp", ".tif", ".tiff", ".ppm", ".pgm" };
+
+static bool IsImagePath(const std::string& path) {
+	size_t dot = path.rfind('.');
+	if (dot == std::string::npos)
+		return false;
+	std::string ext = path.substr(dot);
+	for (size_t k = 0; k < ext.size(); k++)
+		ext[k] = (char) tolower((unsigned char) ext[k]);
+	for (size_t k = 0; k < sizeof(imageExtensions) / sizeof(imageExtensions[0]); k++)
+		if (ext == imageExtensions[k])
+			return true;
+	return false;
+}
+
+static std::string FileName(const std::string& path) {
+	size_t slash = path.find_last_of("/\\");
+	return (slash == std::string::npos) ? path : path.substr(slash + 1);
+}
+
+// The name path is written under in the output directory, folded to lower case where file names
+// are compared without case.
+static std::string OutputKey(const std::string& path) {
+	std::string name = FileName(path);
+#ifdef _WIN32
+	for (size_t k = 0; k < name.size(); k++)
+		name[k] = (char) tolower((unsigned char) name[k]);
+#endif
+	return name;
+}
+
+// Creates the directory path if it does not exist. Returns false if there is no directory there
+// afterwards.
+static bool MakeDirectory(const std::string& path) {
+#ifdef _WIN32
+	_mkdir(path.c_str());
+#else
+	mkdir(path.c_str(), 0777);
+#endif
+	struct stat st;
+	return stat(path.c_str(), &st) == 0 && (st.st_mode & S_IFDIR);
+}
+
+static double MsSince(std::chrono::steady_clock::time_point t0) {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// Nearest-rank percentile of sorted values.
+static double Percentile(const std::vector<double>& sorted, double p) {
+	int rank = (int) (p / 100.0 * sorted.size() + 0.999999);
+	if (rank < 1)
+		rank = 1;
+	if (rank > (int) sorted.size())
+		rank = (int) sorted.size();
+	return sorted[rank - 1];
+}
+
+bool ListBatchInputs(const std::string& input, std::vector<std::string>& paths) {
+	paths.clear();
+	struct stat st;
+	if (stat(input.c_str(), &st) != 0)
+		return false;
+
+	if (st.st_mode & S_IFDIR) {
+		std::vector<std::string> files;
+		cv::glob(input + "/*", files, false);
+		for (size_t k = 0; k < files.size(); k++)
+			if (IsImagePath(files[k]))
+				paths.push_back(files[k]);
+		std::sort(paths.begin(), paths.end());
+		return true;
+	}
+
+	FILE* list = fopen(input.c_str(), "r");
+	if (!list)
+		return false;
+	char line[4096];
+	while (fgets(line, sizeof(line), list)) {
+		size_t n = strlen(line);
+		while (n > 0 && isspace((unsigned char) line[n - 1]))
+			line[--n] = 0;
+		char* p = line;
+		while (isspace((unsigned char) *p))
+			p++;
+		if (*p == 0 || *p == '#')
+			continue;
+		paths.push_back(p);
+	}
+	fclose(list);
+	return true;
+}
+
+int RunBatch(const std::vector<std::string>& paths, const std::string& out_dir, std::vector<BatchWorker*>& workers) {
+	int count = (int) paths.size();
+	if (workers.empty())
+		return count;
+
+	if (!MakeDirectory(out_dir)) {
+		fprintf(stderr, "%s: cannot create the output directory\n", out_dir.c_str());
+		return count;
+	}
+
+	std::vector<double> latency(count, 0.0);
+	std::vector<char> failed(count, 0);
+	std::atomic<int> next(0);
+	std::mutex printLock;
+
+	// outputs are named after their inputs, so of several inputs with one file name (from a list
+	// file) only the first is processed instead of the others overwriting it
+	std::map<std::string, int> names;
+	for (int i = 0; i < count; i++) {
+		std::map<std::string, int>::iterator first = names.find(OutputKey(paths[i]));
+		if (first == names.end()) {
+			names[OutputKey(paths[i])] = i;
+			continue;
+		}
+		failed[i] = 1;
+		fprintf(stderr, "%s: same file name as %s\n", paths[i].c_str(), paths[first->second].c_str());
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (size_t k = 0; k < workers.size(); k++) {
+		BatchWorker* worker = workers[k];
+		threads.push_back(std::thread([&, worker] {
+			cv::Mat input, output;
+			int i;
+			while ((i = next++) < count) {
+				if (failed[i])
+					continue;
+				std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+				const char* error = 0;
+				try {
+					input = cv::imread(paths[i]);
+					if (input.empty())
+						error = "cannot read";
+					else if (!worker->process(input, output))
+						error = "cannot process";
+					else if (!cv::imwrite(out_dir + "/" + FileName(paths[i]), output))
+						error = "cannot write";
+				} catch (const cv::Exception&) {
+					error = "OpenCV error";
+				}
+				latency[i] = MsSince(t0);
+				if (error) {
+					failed[i] = 1;
+					std::unique_lock<std::mutex> guard(printLock);
+					fprintf(stderr, "%s: %s\n", paths[i].c_str(), error);
+				}
+			}
+		}));
+	}
+	for (size_t k = 0; k < threads.size(); k++)
+		threads[k].join();
+	double wall = MsSince(start);
+
+	std::vector<double> sorted;
+	for (int i = 0; i < count; i++)
+		if (!failed[i])
+			sorted.push_back(latency[i]);
+	std::sort(sorted.begin(), sorted.end());
+	int failures = count - (int) sorted.size();
+
+	printf("%d images, %d failed, %.2f s on %d workers, %.2f images/s\n", count, failures, wall / 1000.0,
+			(int) workers.size(), sorted.size() * 1000.0 / (wall > 0.0 ? wall : 1.0));
+	if (!sorted.empty()) {
+		double mean = 0.0;
+		for (size_t k = 0; k < sorted.size(); k++)
+			mean += sorted[k];
+		mean /= sorted.size();
+		printf("latency per image: mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, max %.1f ms\n", mean,
+				Percentile(sorted, 50), Percentile(sorted, 90), Percentile(sorted, 99), sorted.back());
+	}
+	return failures;
+}
@@ -0,0 +1,56 @@
+#ifndef _CLDFILE_H_
+#define _CLDFILE_H_
+
+#include <stddef.h>
+
+#include "cldtile.h"
+
+// Rows of each window RunCLDOnRawFile maps, before the tiler's halo.
+#define CLD_FILE_STRIP_ROWS 512
+
+// A file mapped into memory one window at a time, with CreateFileMapping on Windows and mmap
+// elsewhere. Only the current window is mapped, so a file far larger than memory or than the
+// address space can be walked through. Windows may start at any offset, the alignment the system
+// needs is handled here.
+class MappedFile {
+private:
+#ifdef _WIN32
+	void* file;
+	void* mapping;
+#else
+	int file;
+#endif
+	bool writable;
+	long long size;
+	void* view; // start of the mapped pages
+	size_t view_length;
+
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+public:
+	MappedFile();
+	~MappedFile();
+
+	// Opens path for reading, or creates it with the given size for writing. Returns false if the
+	// file cannot be opened or created.
+	bool open(const char* path, bool write = false, long long size = 0);
+	void close();
+	long long getSize() const {
+		return size;
+	}
+
+	// Maps length bytes from offset, replacing the previous window, and returns their address or 0.
+	// Data written to a writable window reaches the file when it is unmapped.
+	unsigned char* map(long long offset, size_t length);
+	void unmap();
+};
+
+// Runs the line drawing on a raw 8-bit rows x cols image (no header, rows stored one after
+// another) and writes the result to out_path in the same layout. Both files are mapped a strip
+// of rows at a time, for the two passes that find set2's maxima and then for the tiles, so memory
+// use depends on the image width and not on its height. Returns false if a file cannot be opened
+// or mapped, or in_path is smaller than rows x cols.
+bool RunCLDOnRawFile(CldTiler& tiler, const char* in_path, const char* out_path, int rows, int cols, double sigma,
+		double sigma3, double tau, double thres);
+
+#endif
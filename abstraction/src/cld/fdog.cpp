@@ -2,20 +2,50 @@
 
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include <vector>
 
 #include "fdog.h"
 #include "myvec.h"
 #include "imatrix.h"
 #include "ETF.h"
+#include "fastmath.h"
+#include "threadpool.h"
 
 #define ABS(x) ( ((x)>0) ? (x) : (-(x)) )
+#define MIN(x, y) ( ((x)<(y)) ? (x) : (y) )
 #define round(x) ((int) ((x) + 0.5))
 
+// Kernel widths of the production parameters, GetFDoG with sigma 1.0 and sigma3 3.0: the DoG
+// reaches half_w2 = 6 for the 1.6 * sigma Gaussian and the flow DoG half_l = 10. The row kernels
+// have compiled-in variants for them and fall back to the generic ones for other sigmas.
+#define FDOG_PRESET_HALF_W2 6
+#define FDOG_PRESET_HALF_L 10
+
+// SSE2 is always available on x64 and on x86 builds with /arch:SSE2 or -msse2.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FDOG_USE_SSE2
+#include <emmintrin.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#endif
+
+static inline ThreadPool& PoolOrShared(ThreadPool* pool) {
+	return pool ? *pool : ThreadPool::shared();
+}
+
+template<class T>
+static inline void Reserve(mymatrix_t<T>& m, int rows, int cols) {
+	if (m.getRow() != rows || m.getCol() != cols)
+		m.init(rows, cols);
+}
+
 inline double gauss(double x, double mean, double sigma) {
 	return (exp((-(x - mean) * (x - mean)) / (2 * sigma * sigma)) / sqrt(M_PI * 2.0 * sigma * sigma));
 }
 
-void MakeGaussianVector(double sigma, myvec& GAU) {
+template<class T>
+void MakeGaussianVector(double sigma, myvec_t<T>& GAU) {
 	int i, j;
 
 	double threshold = 0.001;
@@ -35,16 +65,18 @@ void MakeGaussianVector(double sigma, myvec& GAU) {
 	}
 }
 
-void GetDirectionalDoG(imatrix& image, ETF& e, mymatrix& dog, myvec& GAU1, myvec& GAU2, double tau) {
-	myvec vn(2);
-	double x, y, d_x, d_y;
-	double weight1, weight2, w_sum1, sum1, sum2, w_sum2;
+template<class T>
+void GetDirectionalDoG(imatrix& image, ETF_t<T>& e, mymatrix_t<T>& dog, myvec_t<T>& GAU1, myvec_t<T>& GAU2,
+		double tau) {
+	myvec_t<T> vn(2);
+	T x, y, d_x, d_y;
+	T weight1, weight2, w_sum1, sum1, sum2, w_sum2;
 
 	int s;
 	int x1, y1;
 	int i, j;
 	int dd;
-	double val;
+	T val;
 
 	int half_w1, half_w2;
 
@@ -79,7 +111,7 @@ void GetDirectionalDoG(imatrix& image, ETF& e, mymatrix& dog, myvec& GAU1, myvec
 				x = d_x + vn[0] * s;
 				y = d_y + vn[1] * s;
 				/////////////////////////////////////////////////////
-				if (x > (double) image_x - 1 || x < 0.0 || y > (double) image_y - 1 || y < 0.0)
+				if (x > (T) image_x - 1 || x < 0.0 || y > (T) image_y - 1 || y < 0.0)
 					continue;
 				x1 = round(x);
 				if (x1 < 0)
@@ -116,14 +148,474 @@ void GetDirectionalDoG(imatrix& image, ETF& e, mymatrix& dog, myvec& GAU1, myvec
 
 }
 
-void GetFlowDoG(ETF& e, mymatrix& dog, mymatrix& tmp, myvec& GAU3) {
-	myvec vt(2);
-	double x, y, d_x, d_y;
-	double weight1, w_sum1, sum1;
+// Computes a single directional DoG response in float precision, skipping samples that fall outside
+// the image exactly as GetDirectionalDoG does. Used for the pixels the SIMD path does not cover.
+// src holds image rows from src_r0 and columns from src_c0, src_stride floats apart.
+static inline float DirectionalDoGPixel(const float* src, int src_r0, int src_c0, int src_stride, int image_x,
+		int image_y, int i, int j, float vn0, float vn1, const float* w1, const float* w2, int half_w2, float tau) {
+	float sum1 = 0.0f, sum2 = 0.0f, w_sum1 = 0.0f, w_sum2 = 0.0f;
+	float dx, dy, val;
+	int s, x1, y1;
+
+	for (s = -half_w2; s <= half_w2; s++) {
+		// Offsets from the centre pixel keep enough float precision to round samples that land
+		// on a half pixel the same way as the double version does.
+		dx = vn0 * s;
+		dy = vn1 * s;
+		if (dx > (float) (image_x - 1 - i) || dx < (float) -i || dy > (float) (image_y - 1 - j) || dy < (float) -j)
+			continue;
+		x1 = i + (int) floorf(dx + 0.5f);
+		if (x1 > image_x - 1)
+			x1 = image_x - 1;
+		y1 = j + (int) floorf(dy + 0.5f);
+		if (y1 > image_y - 1)
+			y1 = image_y - 1;
+		val = src[(x1 - src_r0) * src_stride + y1 - src_c0];
+		sum1 += val * w1[s + half_w2];
+		w_sum1 += w1[s + half_w2];
+		sum2 += val * w2[s + half_w2];
+		w_sum2 += w2[s + half_w2];
+	}
+	return sum1 / w_sum1 - tau * (sum2 / w_sum2);
+}
+
+#ifdef FDOG_USE_SSE2
+// floor(v + 0.5) for each lane, SSE2 only truncates towards zero.
+static inline __m128i RoundOffset(__m128 v) {
+	v = _mm_add_ps(v, _mm_set1_ps(0.5f));
+	__m128i t = _mm_cvttps_epi32(v);
+	return _mm_add_epi32(t, _mm_castps_si128(_mm_cmplt_ps(v, _mm_cvtepi32_ps(t))));
+}
+
+// x * stride + y for each lane, SSE2 only has an unsigned 32x32->64 multiply on the even lanes.
+static inline __m128i FlatIndex(__m128i x, __m128i y, __m128i stride) {
+	__m128i lo = _mm_mul_epu32(x, stride);
+	__m128i hi = _mm_mul_epu32(_mm_srli_si128(x, 4), stride);
+	return _mm_add_epi32(
+			_mm_unpacklo_epi32(_mm_shuffle_epi32(lo, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(hi, _MM_SHUFFLE(0, 0, 2, 0))), y);
+}
+
+static inline __m128i Clamp(__m128i v, __m128i lo, __m128i hi) {
+	__m128i mask = _mm_cmpgt_epi32(v, hi);
+	v = _mm_or_si128(_mm_and_si128(mask, hi), _mm_andnot_si128(mask, v));
+	mask = _mm_cmplt_epi32(v, lo);
+	return _mm_or_si128(_mm_and_si128(mask, lo), _mm_andnot_si128(mask, v));
+}
+
+static inline __m128 Gather(const float* src, __m128i idx) {
+#ifdef __AVX2__
+	return _mm_i32gather_ps(src, idx, 4);
+#else
+	int k[4];
+	_mm_storeu_si128((__m128i *) k, idx);
+	return _mm_setr_ps(src[k[0]], src[k[1]], src[k[2]], src[k[3]]);
+#endif
+}
+#endif
+
+// Directional DoG of columns [col_begin, col_end) of row i, written to dog[0..col_end - col_begin)
+// from the tangents e[0..col_end - col_begin). Four horizontally adjacent pixels are processed per
+// SSE2 register; each sample position is rounded and clamped once and turned into a single index
+// into src, a flat float copy of the image (see DirectionalDoGPixel). Blocks whose whole sampling
+// footprint lies inside the image take an unmasked path with precomputed weight sums, blocks on the
+// border mask out-of-image samples. Blocks start at col_begin, so callers that want the same result
+// for a pixel keep col_begin at the same remainder modulo 4.
+// HALF_W2 > 0 compiles the kernel width in, which unrolls the taps, and copies the weights to the
+// stack where they cannot alias dog, so they stay in registers across the row. HALF_W2 = 0 takes
+// the width from half_w2.
+template<class T, int HALF_W2>
+static void DirectionalDoGRowT(const float* src, int src_r0, int src_c0, int src_stride, int image_x, int image_y,
+		int i, int col_begin, int col_end, const Vect_t<T>* e, T* dog, const float* w1, const float* w2,
+		float w_sum1, float w_sum2, int half_w2, double tau) {
+	int j, s;
+	float ftau = (float) tau;
+	double flat = 255.0 - tau * 255.0;
+
+	float fixed_w1[(HALF_W2 > 0) ? 2 * HALF_W2 + 1 : 1], fixed_w2[(HALF_W2 > 0) ? 2 * HALF_W2 + 1 : 1];
+	if (HALF_W2 > 0) {
+		half_w2 = HALF_W2;
+		for (s = 0; s < 2 * HALF_W2 + 1; s++) {
+			fixed_w1[s] = w1[s];
+			fixed_w2[s] = w2[s];
+		}
+		w1 = fixed_w1;
+		w2 = fixed_w2;
+	}
+
+	// Margin of one pixel on top of half_w2 keeps rounding of unit vectors slightly longer than one
+	// from stepping outside the image on the unmasked path.
+	int margin = half_w2 + 1;
+	bool row_interior = (i - margin >= 0) && (i + margin <= image_x - 1);
+
+	j = col_begin;
+#ifdef FDOG_USE_SSE2
+	const __m128 zero = _mm_setzero_ps();
+	const __m128i zero_i = _mm_setzero_si128();
+	const __m128i max_x1 = _mm_set1_epi32(image_x - 1);
+	const __m128i max_y1 = _mm_set1_epi32(image_y - 1);
+	const __m128i stride = _mm_set1_epi32(src_stride);
+	const __m128i r0 = _mm_set1_epi32(src_r0);
+	const __m128i c0 = _mm_set1_epi32(src_c0);
+	const __m128 inv_w_sum1 = _mm_set1_ps(1.0f / w_sum1);
+	const __m128 inv_w_sum2 = _mm_set1_ps(1.0f / w_sum2);
+	const __m128 vtau = _mm_set1_ps(ftau);
+	const __m128i vi = _mm_set1_epi32(i);
+	const __m128 min_dx = _mm_set1_ps((float) -i);
+	const __m128 max_dx = _mm_set1_ps((float) (image_x - 1 - i));
+
+	for (; j + 4 <= col_end; j += 4) {
+		const Vect_t<T>* t = &e[j - col_begin];
+		T* d = &dog[j - col_begin];
+		float out[4];
+
+		if (t[0].tx == 0.0 && t[0].ty == 0.0 && t[1].tx == 0.0 && t[1].ty == 0.0 && t[2].tx == 0.0 && t[2].ty == 0.0
+				&& t[3].tx == 0.0 && t[3].ty == 0.0) {
+			d[0] = d[1] = d[2] = d[3] = flat;
+			continue;
+		}
+
+		__m128 vn0 = _mm_setr_ps((float) -t[0].ty, (float) -t[1].ty, (float) -t[2].ty, (float) -t[3].ty);
+		__m128 vn1 = _mm_setr_ps((float) t[0].tx, (float) t[1].tx, (float) t[2].tx, (float) t[3].tx);
+		__m128i vj = _mm_setr_epi32(j, j + 1, j + 2, j + 3);
+
+		__m128 sum1 = zero, sum2 = zero;
+		bool interior = row_interior && (j - margin >= 0) && (j + 3 + margin <= image_y - 1);
+
+		if (interior) {
+			for (s = -half_w2; s <= half_w2; s++) {
+				__m128 vs = _mm_set1_ps((float) s);
+				__m128i x1 = _mm_add_epi32(vi, RoundOffset(_mm_mul_ps(vn0, vs)));
+				__m128i y1 = _mm_add_epi32(vj, RoundOffset(_mm_mul_ps(vn1, vs)));
+				__m128 val = Gather(src, FlatIndex(_mm_sub_epi32(x1, r0), _mm_sub_epi32(y1, c0), stride));
+				sum1 = _mm_add_ps(sum1, _mm_mul_ps(val, _mm_set1_ps(w1[s + half_w2])));
+				sum2 = _mm_add_ps(sum2, _mm_mul_ps(val, _mm_set1_ps(w2[s + half_w2])));
+			}
+			sum1 = _mm_mul_ps(sum1, inv_w_sum1);
+			sum2 = _mm_mul_ps(sum2, inv_w_sum2);
+		} else {
+			__m128 ws1 = zero, ws2 = zero;
+			__m128 min_dy = _mm_sub_ps(zero, _mm_cvtepi32_ps(vj));
+			__m128 max_dy = _mm_sub_ps(_mm_set1_ps((float) (image_y - 1)), _mm_cvtepi32_ps(vj));
+			for (s = -half_w2; s <= half_w2; s++) {
+				__m128 vs = _mm_set1_ps((float) s);
+				__m128 dx = _mm_mul_ps(vn0, vs);
+				__m128 dy = _mm_mul_ps(vn1, vs);
+				__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(dx, min_dx), _mm_cmple_ps(dx, max_dx)),
+						_mm_and_ps(_mm_cmpge_ps(dy, min_dy), _mm_cmple_ps(dy, max_dy)));
+				// Clamp so that every lane, including masked ones, gathers a valid pixel.
+				__m128i x1 = _mm_add_epi32(vi, RoundOffset(dx));
+				__m128i y1 = _mm_add_epi32(vj, RoundOffset(dy));
+				x1 = Clamp(x1, zero_i, max_x1);
+				y1 = Clamp(y1, zero_i, max_y1);
+				__m128 val = Gather(src, FlatIndex(_mm_sub_epi32(x1, r0), _mm_sub_epi32(y1, c0), stride));
+				__m128 wt1 = _mm_and_ps(inside, _mm_set1_ps(w1[s + half_w2]));
+				__m128 wt2 = _mm_and_ps(inside, _mm_set1_ps(w2[s + half_w2]));
+				sum1 = _mm_add_ps(sum1, _mm_mul_ps(val, wt1));
+				sum2 = _mm_add_ps(sum2, _mm_mul_ps(val, wt2));
+				ws1 = _mm_add_ps(ws1, wt1);
+				ws2 = _mm_add_ps(ws2, wt2);
+			}
+			sum1 = _mm_div_ps(sum1, ws1);
+			sum2 = _mm_div_ps(sum2, ws2);
+		}
+		_mm_storeu_ps(out, _mm_sub_ps(sum1, _mm_mul_ps(vtau, sum2)));
+
+		for (int k = 0; k < 4; k++) {
+			if (t[k].tx == 0.0 && t[k].ty == 0.0)
+				d[k] = flat;
+			else
+				d[k] = out[k];
+		}
+	}
+#endif
+	for (; j < col_end; j++) {
+		const Vect_t<T>& t = e[j - col_begin];
+		if (t.tx == 0.0 && t.ty == 0.0) {
+			dog[j - col_begin] = flat;
+			continue;
+		}
+		dog[j - col_begin] = DirectionalDoGPixel(src, src_r0, src_c0, src_stride, image_x, image_y, i, j,
+				(float) -t.ty, (float) t.tx, w1, w2, half_w2, ftau);
+	}
+}
+
+// GetDirectionalDoG's arithmetic, in T, for columns [col_begin, col_end) of row i, with the
+// arguments of DirectionalDoGRowT. The image values in src are integers, so reading them from floats
+// changes nothing.
+template<class T>
+static void DirectionalDoGRowReference(const float* src, int src_r0, int src_c0, int src_stride, int image_x,
+		int image_y, int i, int col_begin, int col_end, const Vect_t<T>* e, T* dog, myvec_t<T>& GAU1,
+		myvec_t<T>& GAU2, double tau) {
+	T x, y, vn0, vn1, val;
+	T weight1, weight2, w_sum1, sum1, sum2, w_sum2;
+	int s, x1, y1, j, dd;
+
+	int half_w1 = GAU1.getMax() - 1;
+	int half_w2 = GAU2.getMax() - 1;
+
+	for (j = col_begin; j < col_end; j++) {
+		sum1 = sum2 = 0.0;
+		w_sum1 = w_sum2 = 0.0;
+
+		vn0 = -e[j - col_begin].ty;
+		vn1 = e[j - col_begin].tx;
+
+		if (vn0 == 0.0 && vn1 == 0.0) {
+			dog[j - col_begin] = 255.0 - tau * 255.0;
+			continue;
+		}
+		for (s = -half_w2; s <= half_w2; s++) {
+			x = (T) i + vn0 * s;
+			y = (T) j + vn1 * s;
+			if (x > (T) image_x - 1 || x < 0.0 || y > (T) image_y - 1 || y < 0.0)
+				continue;
+			x1 = round(x);
+			if (x1 > image_x - 1)
+				x1 = image_x - 1;
+			y1 = round(y);
+			if (y1 > image_y - 1)
+				y1 = image_y - 1;
+			val = src[(x1 - src_r0) * src_stride + y1 - src_c0];
+			dd = ABS(s);
+			weight1 = (dd > half_w1) ? (T) 0.0 : GAU1[dd];
+			sum1 += val * weight1;
+			w_sum1 += weight1;
+			weight2 = GAU2[dd];
+			sum2 += val * weight2;
+			w_sum2 += weight2;
+		}
+		sum1 /= w_sum1;
+		sum2 /= w_sum2;
+		dog[j - col_begin] = sum1 - tau * sum2;
+	}
+}
+
+// Runs the compiled-in variant for the production DoG width, the generic one otherwise. The
+// vectorised rows compute in float, which is what the float pipeline is measured against; double is
+// the reference, so it takes GetDirectionalDoG's own arithmetic and only needs GAU1 and GAU2.
+template<class T>
+void DirectionalDoGRow(const float* src, int src_r0, int src_c0, int src_stride, int image_x, int image_y, int i,
+		int col_begin, int col_end, const Vect_t<T>* e, T* dog, const float* w1, const float* w2, float w_sum1,
+		float w_sum2, int half_w2, double tau, myvec_t<T>& GAU1, myvec_t<T>& GAU2) {
+	if (sizeof(T) > sizeof(float))
+		DirectionalDoGRowReference(src, src_r0, src_c0, src_stride, image_x, image_y, i, col_begin, col_end, e, dog,
+				GAU1, GAU2, tau);
+	else if (half_w2 == FDOG_PRESET_HALF_W2)
+		DirectionalDoGRowT<T, FDOG_PRESET_HALF_W2>(src, src_r0, src_c0, src_stride, image_x, image_y, i, col_begin,
+				col_end, e, dog, w1, w2, w_sum1, w_sum2, half_w2, tau);
+	else
+		DirectionalDoGRowT<T, 0>(src, src_r0, src_c0, src_stride, image_x, image_y, i, col_begin, col_end, e, dog, w1,
+				w2, w_sum1, w_sum2, half_w2, tau);
+}
+
+// Per-tap weights of both DoG Gaussians for s = -half_w2..half_w2, GAU1 is zero beyond half_w1.
+template<class T>
+void MakeDoGWeights(myvec_t<T>& GAU1, myvec_t<T>& GAU2, std::vector<float>& w1, std::vector<float>& w2,
+		float& w_sum1, float& w_sum2) {
+	int s, dd;
+	int half_w1 = GAU1.getMax() - 1;
+	int half_w2 = GAU2.getMax() - 1;
+
+	w1.resize(2 * half_w2 + 1);
+	w2.resize(2 * half_w2 + 1);
+	w_sum1 = 0.0f;
+	w_sum2 = 0.0f;
+	for (s = -half_w2; s <= half_w2; s++) {
+		dd = ABS(s);
+		w1[s + half_w2] = (dd > half_w1) ? 0.0f : (float) GAU1[dd];
+		w2[s + half_w2] = (float) GAU2[dd];
+		w_sum1 += w1[s + half_w2];
+		w_sum2 += w2[s + half_w2];
+	}
+}
+
+// Vectorised equivalent of GetDirectionalDoG, see DirectionalDoGRow. For double the rows run the
+// reference arithmetic, so the result is GetDirectionalDoG's exactly, only banded on the pool.
+template<class T>
+void GetDirectionalDoGSIMD(imatrix& image, ETF_t<T>& e, mymatrix_t<T>& dog, myvec_t<T>& GAU1, myvec_t<T>& GAU2,
+		double tau, ThreadPool* threads, FDoGWorkspace_t<T>* workspace) {
+	ThreadPool& pool = PoolOrShared(threads);
+	std::vector<float> local_w1, local_w2, local_src;
+
+	int half_w2 = GAU2.getMax() - 1;
+
+	int image_x = image.getRow();
+	int image_y = image.getCol();
+
+	std::vector<float>& w1 = workspace ? workspace->w1 : local_w1;
+	std::vector<float>& w2 = workspace ? workspace->w2 : local_w2;
+	float w_sum1, w_sum2;
+	MakeDoGWeights(GAU1, GAU2, w1, w2, w_sum1, w_sum2);
+
+	std::vector<float>& src = workspace ? workspace->src : local_src;
+	src.resize(image_x * image_y);
+	pool.parallelFor(image_x, CLD_BAND_ROWS, [&](int row_begin, int row_end) {
+		int i, j;
+		for (i = row_begin; i < row_end; i++) {
+			for (j = 0; j < image_y; j++) {
+				src[i * image_y + j] = (float) image[i][j];
+			}
+		}
+	});
+
+	pool.parallelFor(image_x, CLD_BAND_ROWS, [&](int row_begin, int row_end) {
+		for (int i = row_begin; i < row_end; i++) {
+			DirectionalDoGRow(&src[0], 0, 0, image_y, image_x, image_y, i, 0, image_y, e[i], dog[i], &w1[0], &w2[0],
+					w_sum1, w_sum2, half_w2, tau, GAU1, GAU2);
+		}
+	});
+}
+
+void MakeDoGKernelBank(double sigma, int bins, DoGKernelBank& bank) {
+	int b, s;
+
+	myvec GAU1, GAU2;
+	MakeGaussianVector(sigma, GAU1);
+	MakeGaussianVector(sigma * 1.6, GAU2);
+
+	int half_w2 = GAU2.getMax() - 1;
+	int taps = 2 * half_w2 + 1;
+
+	bank.sigma = sigma;
+	bank.bins = bins;
+	bank.half_w2 = half_w2;
+	bank.dx.resize(bins * taps);
+	bank.dy.resize(bins * taps);
+
+	MakeDoGWeights(GAU1, GAU2, bank.w1, bank.w2, bank.w_sum1, bank.w_sum2);
+
+	for (b = 0; b < bins; b++) {
+		double angle = M_PI * b / bins;
+		double vx = cos(angle);
+		double vy = sin(angle);
+		for (s = -half_w2; s <= half_w2; s++) {
+			bank.dx[b * taps + s + half_w2] = (int) floor(vx * s + 0.5);
+			bank.dy[b * taps + s + half_w2] = (int) floor(vy * s + 0.5);
+		}
+	}
+}
+
+// Angle of (x, y) folded into [0, pi). Uses a polynomial arctangent on [0, 1] (max error 1e-5 rad,
+// far below a bin width) since a libm atan2 per pixel costs about as much as the kernel itself.
+static inline float NormalAngle(float x, float y) {
+	if (y < 0.0f || (y == 0.0f && x < 0.0f)) {
+		x = -x;
+		y = -y;
+	}
+	float ax = ABS(x);
+	bool swap = y > ax;
+	float t = swap ? ax / y : y / ax;
+	float t2 = t * t;
+	float a = t * (0.99997726f + t2 * (-0.33262347f + t2 * (0.19354346f + t2 * (-0.11643287f + t2 * (0.05265332f
+			- t2 * 0.01172120f)))));
+	if (swap)
+		a = (float) M_PI_2 - a;
+	if (x < 0.0f)
+		a = (float) M_PI - a;
+	return a;
+}
+
+// GetDirectionalDoG with the normal of each pixel snapped to one of the bank's directions. Pixels
+// at least half_w2 away from every edge use the bank's flat offsets with no bounds checks.
+template<class T>
+void GetDirectionalDoGQuantized(imatrix& image, ETF_t<T>& e, mymatrix_t<T>& dog, DoGKernelBank& bank, double tau,
+		ThreadPool* threads, FDoGWorkspace_t<T>* workspace) {
+	int b;
+	ThreadPool& pool = PoolOrShared(threads);
+	std::vector<float> local_src;
+	std::vector<int> local_offset;
+
+	int image_x = image.getRow();
+	int image_y = image.getCol();
+
+	int half_w2 = bank.half_w2;
+	int taps = 2 * half_w2 + 1;
+	int bins = bank.bins;
+
+	std::vector<float>& src = workspace ? workspace->src : local_src;
+	src.resize(image_x * image_y);
+	pool.parallelFor(image_x, CLD_BAND_ROWS, [&](int row_begin, int row_end) {
+		int i, j;
+		for (i = row_begin; i < row_end; i++) {
+			for (j = 0; j < image_y; j++) {
+				src[i * image_y + j] = (float) image[i][j];
+			}
+		}
+	});
+
+	std::vector<int>& offset = workspace ? workspace->offset : local_offset;
+	offset.resize(bins * taps);
+	for (b = 0; b < bins * taps; b++) {
+		offset[b] = bank.dx[b] * image_y + bank.dy[b];
+	}
+
+	const float* w1 = &bank.w1[0];
+	const float* w2 = &bank.w2[0];
+	float inv_w_sum1 = 1.0f / bank.w_sum1;
+	float inv_w_sum2 = 1.0f / bank.w_sum2;
+	float ftau = (float) tau;
+	double flat = 255.0 - tau * 255.0;
+	float bin_scale = (float) (bins / M_PI);
+
+	pool.parallelFor(image_x, CLD_BAND_ROWS, [&](int row_begin, int row_end) {
+		int i, j, s, b, x1, y1;
+		float sum1, sum2, w_sum1, w_sum2, val;
+		for (i = row_begin; i < row_end; i++) {
+			bool row_interior = (i - half_w2 >= 0) && (i + half_w2 <= image_x - 1);
+			for (j = 0; j < image_y; j++) {
+				T vn0 = -e[i][j].ty;
+				T vn1 = e[i][j].tx;
+				if (vn0 == 0.0 && vn1 == 0.0) {
+					dog[i][j] = flat;
+					continue;
+				}
+
+				// The kernel is symmetric in s, so directions a half turn apart share a bin.
+				b = (int) (NormalAngle((float) vn0, (float) vn1) * bin_scale + 0.5f);
+				if (b >= bins)
+					b -= bins;
+
+				sum1 = sum2 = 0.0f;
+				if (row_interior && j - half_w2 >= 0 && j + half_w2 <= image_y - 1) {
+					const float* centre = &src[i * image_y + j];
+					const int* off = &offset[b * taps];
+					for (s = 0; s < taps; s++) {
+						val = centre[off[s]];
+						sum1 += val * w1[s];
+						sum2 += val * w2[s];
+					}
+					dog[i][j] = sum1 * inv_w_sum1 - ftau * (sum2 * inv_w_sum2);
+				} else {
+					const int* dx = &bank.dx[b * taps];
+					const int* dy = &bank.dy[b * taps];
+					w_sum1 = w_sum2 = 0.0f;
+					for (s = 0; s < taps; s++) {
+						x1 = i + dx[s];
+						y1 = j + dy[s];
+						if (x1 < 0 || x1 > image_x - 1 || y1 < 0 || y1 > image_y - 1)
+							continue;
+						val = src[x1 * image_y + y1];
+						sum1 += val * w1[s];
+						w_sum1 += w1[s];
+						sum2 += val * w2[s];
+						w_sum2 += w2[s];
+					}
+					dog[i][j] = sum1 / w_sum1 - ftau * (sum2 / w_sum2);
+				}
+			}
+		}
+	});
+}
+
+template<class T>
+void GetFlowDoG(ETF_t<T>& e, mymatrix_t<T>& dog, mymatrix_t<T>& tmp, myvec_t<T>& GAU3) {
+	myvec_t<T> vt(2);
+	T x, y, d_x, d_y;
+	T weight1, w_sum1, sum1;
 
 	int i_x, i_y, k;
 	int x1, y1;
-	double val;
+	T val;
 	int i, j;
 
 	int image_x = dog.getRow();
@@ -134,7 +626,7 @@ void GetFlowDoG(ETF& e, mymatrix& dog, mymatrix& tmp, myvec& GAU3) {
 
 	int flow_DOG_sign = 0;
 
-	double step_size = 1.0;
+	T step_size = 1.0;
 
 	for (i = 0; i < image_x; i++) {
 		for (j = 0; j < image_y; j++) {
@@ -147,8 +639,8 @@ void GetFlowDoG(ETF& e, mymatrix& dog, mymatrix& tmp, myvec& GAU3) {
 			sum1 = val * weight1;
 			w_sum1 += weight1;
 			////////////////////////////////////////////////
-			d_x = (double) i;
-			d_y = (double) j;
+			d_x = (T) i;
+			d_y = (T) j;
 			i_x = i;
 			i_y = j;
 			////////////////////////////
@@ -161,7 +653,7 @@ void GetFlowDoG(ETF& e, mymatrix& dog, mymatrix& tmp, myvec& GAU3) {
 				x = d_x;
 				y = d_y;
 				/////////////////////////////////////////////////////
-				if (x > (double) image_x - 1 || x < 0.0 || y > (double) image_y - 1 || y < 0.0)
+				if (x > (T) image_x - 1 || x < 0.0 || y > (T) image_y - 1 || y < 0.0)
 					break;
 				x1 = round(x);
 				if (x1 < 0)
@@ -190,8 +682,8 @@ void GetFlowDoG(ETF& e, mymatrix& dog, mymatrix& tmp, myvec& GAU3) {
 				/////////////////////////
 			}
 			////////////////////////////////////////////////
-			d_x = (double) i;
-			d_y = (double) j;
+			d_x = (T) i;
+			d_y = (T) j;
 			i_x = i;
 			i_y = j;
 			for (k = 0; k < half_l; k++) {
@@ -203,7 +695,7 @@ void GetFlowDoG(ETF& e, mymatrix& dog, mymatrix& tmp, myvec& GAU3) {
 				x = d_x;
 				y = d_y;
 				/////////////////////////////////////////////////////
-				if (x > (double) image_x - 1 || x < 0.0 || y > (double) image_y - 1 || y < 0.0)
+				if (x > (T) image_x - 1 || x < 0.0 || y > (T) image_y - 1 || y < 0.0)
 					break;
 				x1 = round(x);
 				if (x1 < 0)
@@ -242,114 +734,516 @@ void GetFlowDoG(ETF& e, mymatrix& dog, mymatrix& tmp, myvec& GAU3) {
 	}
 }
 
-void GetFDoG(imatrix& image, ETF& e, double sigma, double sigma3, double tau) {
-	int i, j;
+// Marks the pixels the flow DoG has to trace, a conservative test that leaves the result unchanged.
+// Sample k of either streamline lies within k pixels of its start in each axis, and the start pixel
+// itself is counted three times with weight GAU3[0]. With low_k the smallest DoG value in the
+// (2k + 1)^2 square around the pixel, the flow DoG's weighted sum is therefore at least
+//   3 * GAU3[0] * dog + 2 * sum_k GAU3[k] * min(0, low_k),
+// streamlines that stop early only drop terms. Where that bound is positive the result is exactly 1
+// and the pixel is skipped. low_k grows from low_(k-1) by a 3x3 minimum.
+template<class T>
+void MakeFlowDoGMask(mymatrix_t<T>& dog, myvec_t<T>& GAU3, std::vector<unsigned char>& mask, ThreadPool* threads,
+		FDoGWorkspace_t<T>* workspace) {
+	ThreadPool& pool = PoolOrShared(threads);
+	std::vector<T> local_low, local_row_low, local_bound;
+
+	int image_x = dog.getRow();
+	int image_y = dog.getCol();
+	int half_l = GAU3.getMax() - 1;
+
+	std::vector<T>& low = workspace ? workspace->low : local_low;
+	std::vector<T>& row_low = workspace ? workspace->row_low : local_row_low;
+	std::vector<T>& bound = workspace ? workspace->bound : local_bound;
+	low.resize(image_x * image_y);
+	row_low.resize(image_x * image_y);
+	bound.resize(image_x * image_y);
+	mask.resize(image_x * image_y);
+
+	pool.parallelFor(image_x, CLD_BAND_ROWS, [&](int row_begin, int row_end) {
+		int i, j;
+		for (i = row_begin; i < row_end; i++) {
+			for (j = 0; j < image_y; j++) {
+				low[i * image_y + j] = dog[i][j];
+				bound[i * image_y + j] = 3 * GAU3[0] * dog[i][j];
+			}
+		}
+	});
+
+	for (int k = 1; k < half_l; k++) {
+		T w = 2 * GAU3[k];
+		pool.parallelFor(image_x, CLD_BAND_ROWS, [&](int row_begin, int row_end) {
+			int i, j;
+			for (i = row_begin; i < row_end; i++) {
+				const T* l = &low[i * image_y];
+				T* r = &row_low[i * image_y];
+				r[0] = (image_y > 1 && l[1] < l[0]) ? l[1] : l[0];
+				for (j = 1; j < image_y - 1; j++)
+					r[j] = MIN(MIN(l[j - 1], l[j]), l[j + 1]);
+				if (image_y > 1)
+					r[image_y - 1] = MIN(l[image_y - 2], l[image_y - 1]);
+			}
+		});
+		pool.parallelFor(image_x, CLD_BAND_ROWS, [&](int row_begin, int row_end) {
+			int i, j;
+			for (i = row_begin; i < row_end; i++) {
+				const T* up = &row_low[((i > 0) ? i - 1 : i) * image_y];
+				const T* r = &row_low[i * image_y];
+				const T* down = &row_low[((i < image_x - 1) ? i + 1 : i) * image_y];
+				T* l = &low[i * image_y];
+				T* b = &bound[i * image_y];
+				for (j = 0; j < image_y; j++) {
+					T v = MIN(MIN(up[j], r[j]), down[j]);
+					l[j] = v;
+					b[j] += w * MIN(v, (T) 0);
+				}
+			}
+		});
+	}
+
+	// The margin covers rounding in the flow DoG's own sum, which is taken in another order.
+	pool.parallelFor(image_x, CLD_BAND_ROWS, [&](int row_begin, int row_end) {
+		int i, j;
+		for (i = row_begin; i < row_end; i++) {
+			for (j = 0; j < image_y; j++) {
+				T d = dog[i][j];
+				mask[i * image_y + j] = !(d > 0 && bound[i * image_y + j] > (T) 1e-3 * GAU3[0] * d);
+			}
+		}
+	});
+}
+
+// Flow DoG of columns [col_begin, col_end) of row i, written to out[0..col_end - col_begin). field
+// packs the tangent field and the DoG side by side, it holds image rows from field_r0 and columns
+// from field_c0, field_stride samples apart, and must cover every pixel within half_l of the traced
+// ones. The forward and backward streamlines of FLOW_BLOCK neighbouring pixels are advanced in
+// lockstep. Every streamline is a chain of dependent loads; interleaving independent chains lets
+// their cache misses overlap instead of queueing. If mask is given, only pixels with a non-zero
+// mask[j - col_begin] are traced and the rest are set to 1, see MakeFlowDoGMask. The block then
+// takes the next FLOW_BLOCK traced pixels of the row.
+// HALF_L > 0 compiles the streamline length in, HALF_L = 0 takes it from GAU3.
+#define FLOW_BLOCK 8
+template<class T, int HALF_L>
+static void FlowDoGRowT(const FlowSample_t<T>* field, int field_r0, int field_c0, int field_stride, int image_x,
+		int image_y, int i, int col_begin, int col_end, myvec_t<T>& GAU3, const unsigned char* mask, T* out) {
+	int j, k, c, n;
+	bool fast = GetFastMath();
+
+	int half_l = (HALF_L > 0) ? HALF_L : GAU3.getMax() - 1;
+
+	// weights on the stack, where stores to out cannot change them
+	T fixed_gau[(HALF_L > 0) ? HALF_L + 1 : 1];
+	const T* gau = &GAU3[0];
+	if (HALF_L > 0) {
+		for (k = 0; k <= HALF_L; k++)
+			fixed_gau[k] = GAU3[k];
+		gau = fixed_gau;
+	}
+
+	// Chain 2 * p follows pixel col[p] of the block forwards, chain 2 * p + 1 backwards.
+	const int chains = 2 * FLOW_BLOCK;
+	T d_x[chains], d_y[chains], sum[chains], w_sum[chains];
+	int idx[chains];
+	bool active[chains];
+	int col[FLOW_BLOCK];
+
+	j = col_begin;
+	while (j < col_end) {
+		for (n = 0; j < col_end && n < FLOW_BLOCK; j++) {
+			if (mask && !mask[j - col_begin]) {
+				out[j - col_begin] = 1.0;
+				continue;
+			}
+			col[n++] = j;
+		}
+		if (n == 0)
+			break;
+
+		for (c = 0; c < chains; c++) {
+			active[c] = (c / 2 < n);
+			int y = active[c] ? col[c / 2] : col_begin;
+			d_x[c] = (T) i;
+			d_y[c] = (T) y;
+			idx[c] = (i - field_r0) * field_stride + y - field_c0;
+			sum[c] = w_sum[c] = 0.0;
+		}
+
+		for (k = 0; k < half_l; k++) {
+			bool any = false;
+			for (c = 0; c < chains; c++) {
+				if (!active[c])
+					continue;
+				const FlowSample_t<T>& f = field[idx[c]];
+				T vt0 = (c & 1) ? -f.tx : f.tx;
+				T vt1 = (c & 1) ? -f.ty : f.ty;
+				if (vt0 == 0.0 && vt1 == 0.0) {
+					active[c] = false;
+					continue;
+				}
+				sum[c] += f.dog * gau[k];
+				w_sum[c] += gau[k];
+				d_x[c] += vt0;
+				d_y[c] += vt1;
+				if (d_x[c] < 0 || d_x[c] > image_x - 1 || d_y[c] < 0 || d_y[c] > image_y - 1) {
+					active[c] = false;
+					continue;
+				}
+				idx[c] = (round(d_x[c]) - field_r0) * field_stride + round(d_y[c]) - field_c0;
+				any = true;
+			}
+			if (!any)
+				break;
+		}
+
+		for (c = 0; c < n; c++) {
+			T dog = field[(i - field_r0) * field_stride + col[c] - field_c0].dog;
+			T total = dog * gau[0] + sum[2 * c] + sum[2 * c + 1];
+			total /= gau[0] + w_sum[2 * c] + w_sum[2 * c + 1];
+			if (total > 0)
+				out[col[c] - col_begin] = 1.0;
+			else
+				out[col[c] - col_begin] = 1.0 + (fast ? (T) tanhf_fast((float) total) : tanh(total));
+		}
+	}
+}
+
+// Runs the compiled-in variant for the production streamline length, the generic one otherwise.
+template<class T>
+void FlowDoGRow(const FlowSample_t<T>* field, int field_r0, int field_c0, int field_stride, int image_x, int image_y,
+		int i, int col_begin, int col_end, myvec_t<T>& GAU3, const unsigned char* mask, T* out) {
+	if (GAU3.getMax() - 1 == FDOG_PRESET_HALF_L)
+		FlowDoGRowT<T, FDOG_PRESET_HALF_L>(field, field_r0, field_c0, field_stride, image_x, image_y, i, col_begin,
+				col_end, GAU3, mask, out);
+	else
+		FlowDoGRowT<T, 0>(field, field_r0, field_c0, field_stride, image_x, image_y, i, col_begin, col_end, GAU3, mask,
+				out);
+}
+
+// Same result as GetFlowDoG, up to the order in which the weighted samples are summed. The tangent
+// field and the DoG are packed into one flat array and traced by FlowDoGRow.
+template<class T>
+void GetFlowDoGInterleaved(ETF_t<T>& e, mymatrix_t<T>& dog, mymatrix_t<T>& tmp, myvec_t<T>& GAU3,
+		ThreadPool* threads, FDoGWorkspace_t<T>* workspace, const unsigned char* mask) {
+	ThreadPool& pool = PoolOrShared(threads);
+	std::vector<FlowSample_t<T> > local_field;
+
+	int image_x = dog.getRow();
+	int image_y = dog.getCol();
+
+	std::vector<FlowSample_t<T> >& field = workspace ? workspace->field : local_field;
+	field.resize(image_x * image_y);
+	pool.parallelFor(image_x, CLD_BAND_ROWS, [&](int row_begin, int row_end) {
+		int i, j;
+		for (i = row_begin; i < row_end; i++) {
+			for (j = 0; j < image_y; j++) {
+				FlowSample_t<T>& f = field[i * image_y + j];
+				f.tx = e[i][j].tx;
+				f.ty = e[i][j].ty;
+				f.dog = dog[i][j];
+			}
+		}
+	});
+
+	pool.parallelFor(image_x, CLD_BAND_ROWS, [&](int row_begin, int row_end) {
+		for (int i = row_begin; i < row_end; i++) {
+			FlowDoGRow(&field[0], 0, 0, image_y, image_x, image_y, i, 0, image_y, GAU3,
+					mask ? mask + i * image_y : 0, tmp[i]);
+		}
+	});
+}
+
+template<class T, class V>
+void FDoGOutputRow(const T* line, int n, V* out, const FDoGOptions_t<T>& options) {
+	int j, v;
+	int threshold_mode = options.threshold_mode;
+	double thres = options.thres;
+
+	for (j = 0; j < n; j++) {
+		v = round(line[j] * 255.);
+		if (threshold_mode == FDOG_THRESHOLD_BINARIZE)
+			v = (v / 255.0 < thres) ? 0 : 255;
+		else if (threshold_mode == FDOG_THRESHOLD_GRAY && v / 255.0 >= thres)
+			v = 255;
+		out[j] = (V) v;
+	}
+}
+
+template<class T>
+void GetFDoG(imatrix& image, ETF_t<T>& e, double sigma, double sigma3, double tau, const FDoGOptions_t<T>& options) {
+	ThreadPool& pool = PoolOrShared(options.threads);
+	FDoGWorkspace_t<T>* owned = options.workspace ? 0 : new FDoGWorkspace_t<T>;
+	FDoGWorkspace_t<T>& ws = options.workspace ? *options.workspace : *owned;
 
 	int image_x = image.getRow();
 	int image_y = image.getCol();
 
-	myvec GAU1, GAU2, GAU3;
-	MakeGaussianVector(sigma, GAU1);
-	MakeGaussianVector(sigma * 1.6, GAU2);
+	if (ws.sigma != sigma) {
+		MakeGaussianVector(sigma, ws.GAU1);
+		MakeGaussianVector(sigma * 1.6, ws.GAU2);
+		ws.sigma = sigma;
+	}
+	if (ws.sigma3 != sigma3) {
+		MakeGaussianVector(sigma3, ws.GAU3);
+		ws.sigma3 = sigma3;
+	}
 
-	int half_w1, half_w2, half_l;
-	half_w1 = GAU1.getMax() - 1;
-	half_w2 = GAU2.getMax() - 1;
+	mymatrix_t<T>& tmp = ws.tmp;
+	mymatrix_t<T>& dog = ws.dog;
+	Reserve(tmp, image_x, image_y);
+	Reserve(dog, image_x, image_y);
 
-	MakeGaussianVector(sigma3, GAU3);
-	half_l = GAU3.getMax() - 1;
+	if (options.angle_bins > 0) {
+		if (ws.bank.sigma != sigma || ws.bank.bins != options.angle_bins)
+			MakeDoGKernelBank(sigma, options.angle_bins, ws.bank);
+		GetDirectionalDoGQuantized(image, e, dog, ws.bank, tau, &pool, &ws);
+	} else {
+		GetDirectionalDoGSIMD(image, e, dog, ws.GAU1, ws.GAU2, tau, &pool, &ws);
+	}
+	if (options.sparse) {
+		MakeFlowDoGMask(dog, ws.GAU3, ws.mask, &pool, &ws);
+		GetFlowDoGInterleaved(e, dog, tmp, ws.GAU3, &pool, &ws, &ws.mask[0]);
+	} else {
+		GetFlowDoGInterleaved(e, dog, tmp, ws.GAU3, &pool, &ws);
+	}
 
-	mymatrix tmp(image_x, image_y);
-	mymatrix dog(image_x, image_y);
+	// Epilogue: the threshold is applied while each pixel is still in cache, instead of in a
+	// separate pass over the image.
+	pool.parallelFor(image_x, CLD_BAND_ROWS, [&](int row_begin, int row_end) {
+		for (int i = row_begin; i < row_end; i++)
+			FDoGOutputRow(tmp[i], image_y, image[i], options);
+	});
 
-	GetDirectionalDoG(image, e, dog, GAU1, GAU2, tau);
-	GetFlowDoG(e, dog, tmp, GAU3);
+	delete owned;
+}
 
-	for (i = 0; i < image_x; i++) {
-		for (j = 0; j < image_y; j++) {
-			image[i][j] = round(tmp[i][j] * 255.);
+// Columns the separable blurs accumulate at a time, in registers or L1.
+#define FDOG_CHUNK 64
+
+// Horizontal blurs of a column whose window leaves the image, normalised by the weights inside.
+static inline void XDoGBorderPixel(const int* row, int image_y, int j, const float* w1, const float* w2, int half_w2,
+		float* b1, float* b2) {
+	float sum1 = 0.0f, sum2 = 0.0f, w_sum1 = 0.0f, w_sum2 = 0.0f;
+	for (int s = -half_w2; s <= half_w2; s++) {
+		if (j + s < 0 || j + s >= image_y)
+			continue;
+		sum1 += w1[s + half_w2] * (float) row[j + s];
+		sum2 += w2[s + half_w2] * (float) row[j + s];
+		w_sum1 += w1[s + half_w2];
+		w_sum2 += w2[s + half_w2];
+	}
+	b1[j] = sum1 / w_sum1;
+	b2[j] = sum2 / w_sum2;
+}
+
+template<class T>
+void GetXDoG(imatrix& image, double sigma, double tau, const FDoGOptions_t<T>& options) {
+	ThreadPool& pool = PoolOrShared(options.threads);
+	FDoGWorkspace_t<T>* owned = options.workspace ? 0 : new FDoGWorkspace_t<T>;
+	FDoGWorkspace_t<T>& ws = options.workspace ? *options.workspace : *owned;
+
+	int image_x = image.getRow();
+	int image_y = image.getCol();
+
+	if (ws.sigma != sigma) {
+		MakeGaussianVector(sigma, ws.GAU1);
+		MakeGaussianVector(sigma * 1.6, ws.GAU2);
+		ws.sigma = sigma;
+	}
+	float w_sum1, w_sum2;
+	MakeDoGWeights(ws.GAU1, ws.GAU2, ws.w1, ws.w2, w_sum1, w_sum2);
+	const float* w1 = &ws.w1[0];
+	const float* w2 = &ws.w2[0];
+	int half_w2 = ws.GAU2.getMax() - 1;
+
+	std::vector<float>& blur1 = ws.blur1;
+	std::vector<float>& blur2 = ws.blur2;
+	blur1.resize(image_x * image_y);
+	blur2.resize(image_x * image_y);
+	Reserve(ws.tmp, image_x, image_y);
+
+	// Horizontal pass. Columns whose window is inside the image share the full weight sums, the
+	// others skip what falls outside and are normalised by the weights they used.
+	int inner_begin = half_w2;
+	int inner_end = (image_y - half_w2 > half_w2) ? image_y - half_w2 : half_w2;
+	pool.parallelFor(image_x, CLD_BAND_ROWS, [&](int row_begin, int row_end) {
+		float acc1[FDOG_CHUNK], acc2[FDOG_CHUNK];
+		int i, j, s, c, n;
+		for (i = row_begin; i < row_end; i++) {
+			const int* row = image[i];
+			float* b1 = &blur1[i * image_y];
+			float* b2 = &blur2[i * image_y];
+			for (j = inner_begin; j < inner_end; j += FDOG_CHUNK) {
+				n = (inner_end - j < FDOG_CHUNK) ? inner_end - j : FDOG_CHUNK;
+				for (c = 0; c < n; c++) {
+					acc1[c] = 0.0f;
+					acc2[c] = 0.0f;
+				}
+				for (s = 0; s < 2 * half_w2 + 1; s++) {
+					const int* p = row + j - half_w2 + s;
+					for (c = 0; c < n; c++) {
+						acc1[c] += w1[s] * (float) p[c];
+						acc2[c] += w2[s] * (float) p[c];
+					}
+				}
+				for (c = 0; c < n; c++) {
+					b1[j + c] = acc1[c] / w_sum1;
+					b2[j + c] = acc2[c] / w_sum2;
+				}
+			}
+			for (j = 0; j < inner_begin && j < image_y; j++)
+				XDoGBorderPixel(row, image_y, j, w1, w2, half_w2, b1, b2);
+			for (j = inner_end; j < image_y; j++)
+				XDoGBorderPixel(row, image_y, j, w1, w2, half_w2, b1, b2);
 		}
+	});
+
+	// Vertical pass, then the DoG, the ramp and the epilogue of GetFDoG for each finished row.
+	bool fast = GetFastMath();
+	pool.parallelFor(image_x, CLD_BAND_ROWS, [&](int row_begin, int row_end) {
+		float acc1[FDOG_CHUNK], acc2[FDOG_CHUNK];
+		int i, j, r, c, n;
+		for (i = row_begin; i < row_end; i++) {
+			int r0 = (i - half_w2 > 0) ? i - half_w2 : 0;
+			int r1 = (i + half_w2 < image_x - 1) ? i + half_w2 : image_x - 1;
+			float ws1 = 0.0f, ws2 = 0.0f;
+			for (r = r0; r <= r1; r++) {
+				ws1 += w1[r - i + half_w2];
+				ws2 += w2[r - i + half_w2];
+			}
+			float tau1 = (float) tau * ws1 / ws2;
+			T* line = ws.tmp[i];
+			for (j = 0; j < image_y; j += FDOG_CHUNK) {
+				n = (image_y - j < FDOG_CHUNK) ? image_y - j : FDOG_CHUNK;
+				for (c = 0; c < n; c++) {
+					acc1[c] = 0.0f;
+					acc2[c] = 0.0f;
+				}
+				for (r = r0; r <= r1; r++) {
+					const float* p1 = &blur1[r * image_y + j];
+					const float* p2 = &blur2[r * image_y + j];
+					float k1 = w1[r - i + half_w2];
+					float k2 = w2[r - i + half_w2];
+					for (c = 0; c < n; c++) {
+						acc1[c] += k1 * p1[c];
+						acc2[c] += k2 * p2[c];
+					}
+				}
+				// the DoG goes to acc1 and its tanh to acc2, a whole chunk at a time
+				for (c = 0; c < n; c++)
+					acc1[c] = (acc1[c] - tau1 * acc2[c]) / ws1;
+				if (fast) {
+					tanhfv_fast(acc1, n, acc2);
+				} else {
+					for (c = 0; c < n; c++)
+						acc2[c] = (float) tanh((T) acc1[c]);
+				}
+				for (c = 0; c < n; c++)
+					line[j + c] = (acc1[c] > 0) ? (T) 1.0 : (T) (1.0 + acc2[c]);
+			}
+			FDoGOutputRow(line, image_y, image[i], options);
+		}
+	});
+
+	delete owned;
+}
+
+// Separable Gaussian blur of image with clamped borders, rounded back to integers. The vertical
+// pass runs along whole rows into rows padded by the kernel radius on both sides; the padding
+// repeats the end columns, so the horizontal pass needs no bounds tests. Both passes run in row
+// bands with T accumulators, float by default.
+template<class T>
+int MakeGaussTaps(double sigma, std::vector<T>& taps) {
+	// the taps of MakeGaussianVector, normalised once: clamping keeps every tap
+	int half = 0;
+	while (gauss((double) ++half, 0.0, sigma) >= 0.001)
+		;
+	taps.resize(2 * half + 1);
+	T w_sum = 0.0;
+	for (int s = -half; s <= half; s++) {
+		taps[s + half] = (T) gauss((double) s, 0.0, sigma);
+		w_sum += taps[s + half];
 	}
+	for (int s = 0; s <= 2 * half; s++)
+		taps[s] /= w_sum;
+	return half;
 }
 
-void GaussSmoothSep(imatrix& image, double sigma) {
-	int i, j;
-	int MAX_GRADIENT = -1;
-	double g, max_g, min_g;
-	int s, t;
-	int x, y;
-	double weight, w_sum;
+template<class S, class T>
+void GaussAccumulateRow(const S* src, T weight, T* acc, int n) {
+	for (int j = 0; j < n; j++)
+		acc[j] += weight * (T) src[j];
+}
+
+static inline void StoreBlurred(float v, int& dst) {
+	dst = round(v);
+}
+
+static inline void StoreBlurred(double v, int& dst) {
+	dst = round(v);
+}
+
+template<class T>
+static inline void StoreBlurred(T v, T& dst) {
+	dst = v;
+}
+
+template<class T, class D>
+void GaussPaddedRow(const T* row, D* dst, int n, const T* w, int half) {
+	T acc[FDOG_CHUNK];
+	int j, s, c, m;
+	for (j = 0; j < n; j += FDOG_CHUNK) {
+		m = (n - j < FDOG_CHUNK) ? n - j : FDOG_CHUNK;
+		for (c = 0; c < m; c++)
+			acc[c] = 0.0;
+		for (s = 0; s <= 2 * half; s++) {
+			const T* q = row + j + s;
+			T weight = w[s];
+			for (c = 0; c < m; c++)
+				acc[c] += weight * q[c];
+		}
+		for (c = 0; c < m; c++)
+			StoreBlurred(acc[c], dst[j + c]);
+	}
+}
+
+template<class T>
+void GaussSmoothSep(imatrix& image, double sigma, ThreadPool* threads, FDoGWorkspace_t<T>* workspace) {
+	ThreadPool& pool = PoolOrShared(threads);
+	std::vector<T> local_padded, local_taps;
 
 	int image_x = image.getRow();
 	int image_y = image.getCol();
 
-	myvec GAU1;
-	MakeGaussianVector(sigma, GAU1);
-	int half = GAU1.getMax() - 1;
+	std::vector<T>& taps = workspace ? workspace->smooth_taps : local_taps;
+	int half = MakeGaussTaps(sigma, taps);
+	const T* w = &taps[0];
 
-	mymatrix tmp(image_x, image_y);
+	int stride = image_y + 2 * half;
+	std::vector<T>& padded = workspace ? workspace->smooth_rows : local_padded;
+	padded.resize((size_t) image_x * stride);
 
-	max_g = -1;
-	min_g = 10000000;
-	for (j = 0; j < image_y; j++) {
-		for (i = 0; i < image_x; i++) {
-			g = 0.0;
-			weight = w_sum = 0.0;
+	pool.parallelFor(image_x, CLD_BAND_ROWS, [&](int row_begin, int row_end) {
+		int i, j, s, x;
+		for (i = row_begin; i < row_end; i++) {
+			T* row = &padded[(size_t) i * stride];
+			T* out = row + half;
+			for (j = 0; j < image_y; j++)
+				out[j] = 0.0;
 			for (s = -half; s <= half; s++) {
 				x = i + s;
-				y = j;
-				if (x > image_x - 1)
-					x = image_x - 1;
-				else if (x < 0)
-					x = 0;
-				if (y > image_y - 1)
-					y = image_y - 1;
-				else if (y < 0)
-					y = 0;
-				weight = GAU1[ABS(s)];
-				g += weight * image[x][y];
-				w_sum += weight;
+				x = (x < 0) ? 0 : (x > image_x - 1) ? image_x - 1 : x;
+				GaussAccumulateRow(image[x], w[s + half], out, image_y);
 			}
-			g /= w_sum;
-			if (g > max_g)
-				max_g = g;
-			if (g < min_g)
-				min_g = g;
-			tmp[i][j] = g;
-		}
-	}
-	for (j = 0; j < image_y; j++) {
-		for (i = 0; i < image_x; i++) {
-			g = 0.0;
-			weight = w_sum = 0.0;
-			for (t = -half; t <= half; t++) {
-				x = i;
-				y = j + t;
-				if (x > image_x - 1)
-					x = image_x - 1;
-				else if (x < 0)
-					x = 0;
-				if (y > image_y - 1)
-					y = image_y - 1;
-				else if (y < 0)
-					y = 0;
-				weight = GAU1[ABS(t)];
-				g += weight * tmp[x][y];
-				w_sum += weight;
+			for (j = 0; j < half; j++) {
+				row[j] = out[0];
+				out[image_y + j] = out[image_y - 1];
 			}
-			g /= w_sum;
-			if (g > max_g)
-				max_g = g;
-			if (g < min_g)
-				min_g = g;
-			image[i][j] = round(g);
 		}
-	}
+	});
 
-	// This code comes from stdafx.h, a import for Visual Studio, the TRACE function sends
-	// info to the debugger.
-//	TRACE("max_g = %f\n", max_g);
-//	TRACE("min_g = %f\n", min_g);
+	pool.parallelFor(image_x, CLD_BAND_ROWS, [&](int row_begin, int row_end) {
+		for (int i = row_begin; i < row_end; i++)
+			GaussPaddedRow(&padded[(size_t) i * stride], image[i], image_y, w, half);
+	});
 }
 
 void ConstructMergedImage(imatrix& image, imatrix& gray, imatrix& merged) {
@@ -423,3 +1317,34 @@ void GrayThresholding(imatrix& image, double thres) {
 	}
 }
 
+#define FDOG_INSTANTIATE(T) \
+	template void MakeGaussianVector(double, myvec_t<T>&); \
+	template void GetDirectionalDoG(imatrix&, ETF_t<T>&, mymatrix_t<T>&, myvec_t<T>&, myvec_t<T>&, double); \
+	template void GetDirectionalDoGSIMD(imatrix&, ETF_t<T>&, mymatrix_t<T>&, myvec_t<T>&, myvec_t<T>&, double, \
+			ThreadPool*, FDoGWorkspace_t<T>*); \
+	template void GetDirectionalDoGQuantized(imatrix&, ETF_t<T>&, mymatrix_t<T>&, DoGKernelBank&, double, \
+			ThreadPool*, FDoGWorkspace_t<T>*); \
+	template void GetFlowDoG(ETF_t<T>&, mymatrix_t<T>&, mymatrix_t<T>&, myvec_t<T>&); \
+	template void MakeFlowDoGMask(mymatrix_t<T>&, myvec_t<T>&, std::vector<unsigned char>&, ThreadPool*, \
+			FDoGWorkspace_t<T>*); \
+	template void DirectionalDoGRow(const float*, int, int, int, int, int, int, int, int, const Vect_t<T>*, T*, \
+			const float*, const float*, float, float, int, double, myvec_t<T>&, myvec_t<T>&); \
+	template void FlowDoGRow(const FlowSample_t<T>*, int, int, int, int, int, int, int, int, myvec_t<T>&, \
+			const unsigned char*, T*); \
+	template void GetFlowDoGInterleaved(ETF_t<T>&, mymatrix_t<T>&, mymatrix_t<T>&, myvec_t<T>&, ThreadPool*, \
+			FDoGWorkspace_t<T>*, const unsigned char*); \
+	template void MakeDoGWeights(myvec_t<T>&, myvec_t<T>&, std::vector<float>&, std::vector<float>&, float&, \
+			float&); \
+	template void FDoGOutputRow(const T*, int, int*, const FDoGOptions_t<T>&); \
+	template void FDoGOutputRow(const T*, int, unsigned char*, const FDoGOptions_t<T>&); \
+	template int MakeGaussTaps(double, std::vector<T>&); \
+	template void GaussAccumulateRow(const int*, T, T*, int); \
+	template void GaussAccumulateRow(const T*, T, T*, int); \
+	template void GaussPaddedRow(const T*, int*, int, const T*, int); \
+	template void GaussPaddedRow(const T*, T*, int, const T*, int); \
+	template void GaussSmoothSep(imatrix&, double, ThreadPool*, FDoGWorkspace_t<T>*); \
+	template void GetFDoG(imatrix&, ETF_t<T>&, double, double, double, const FDoGOptions_t<T>&); \
+	template void GetXDoG(imatrix&, double, double, const FDoGOptions_t<T>&);
+
+FDOG_INSTANTIATE(float)
+FDOG_INSTANTIATE(double)
@@ -1,13 +1,143 @@
 #ifndef _FDOG_H_
 #define _FDOG_H_
 
+#include <vector>
+
 #include "imatrix.h"
 #include "ETF.h"
+#include "myvec.h"
+#include "threadpool.h"
+
+// Directional DoG kernels for a fixed number of normal directions. The normal of each pixel is
+// snapped to the nearest of "bins" angles in [0, pi) and the DoG is taken over that bin's integer
+// pixel offsets, so no sample positions are computed per pixel. Snapping moves a sample at most
+// half_w2 * sin(pi / (2 * bins)) pixels off the true normal, e.g. 0.29px for sigma = 1, bins = 32.
+struct DoGKernelBank {
+	double sigma;
+	int bins;
+	int half_w2;
+	std::vector<int> dx, dy; // bins rows of 2 * half_w2 + 1 offsets, s = -half_w2..half_w2
+	std::vector<float> w1, w2; // per-tap weights, shared by all bins
+	float w_sum1, w_sum2;
+};
+
+// Tangent and DoG of one pixel side by side, so that a streamline step touches one cache line.
+template<class T>
+struct FlowSample_t {
+	T tx, ty, dog;
+};
+
+// Scratch memory of the FDoG stages. Buffers grow to the largest image seen and kernels are rebuilt
+// only when their sigma changes, so repeated calls at one resolution do not allocate.
+template<class T>
+struct FDoGWorkspace_t {
+	mymatrix_t<T> dog, tmp;
+	std::vector<float> src; // input plane as flat floats
+	std::vector<float> w1, w2;
+	std::vector<int> offset;
+	std::vector<FlowSample_t<T> > field;
+	std::vector<unsigned char> mask; // pixels the flow DoG traces
+	std::vector<T> low, row_low, bound;
+	std::vector<float> blur1, blur2; // GetXDoG's horizontal blurs
+	std::vector<T> smooth_rows, smooth_taps; // GaussSmoothSep's padded rows and weights
+	myvec_t<T> GAU1, GAU2, GAU3;
+	double sigma, sigma3; // sigmas GAU1/GAU2 and GAU3 were built for, 0 if not built yet
+	DoGKernelBank bank; // bank.bins is 0 if not built yet
+
+	FDoGWorkspace_t() :
+			sigma(0.0), sigma3(0.0) {
+		bank.sigma = 0.0;
+		bank.bins = 0;
+	}
+};
+
+// Thresholds GetFDoG can apply to each line pixel as it is produced, with the semantics of
+// Binarize and GrayThresholding.
+#define FDOG_THRESHOLD_NONE 0
+#define FDOG_THRESHOLD_BINARIZE 1
+#define FDOG_THRESHOLD_GRAY 2
+
+template<class T>
+struct FDoGOptions_t {
+	int angle_bins; // 0 samples along the exact normal, otherwise uses a DoGKernelBank with this many bins
+	ThreadPool* threads; // pool the row bands run on, 0 for ThreadPool::shared()
+	FDoGWorkspace_t<T>* workspace; // buffers reused between calls, 0 for temporaries
+	bool sparse; // trace the flow DoG only where it can be below 1, the result is the same
+
+	int threshold_mode; // FDOG_THRESHOLD_*
+	double thres;
+
+	FDoGOptions_t() :
+			angle_bins(0), threads(0), workspace(0), sparse(false), threshold_mode(FDOG_THRESHOLD_NONE), thres(0.0) {
+	}
+};
+
+typedef FDoGWorkspace_t<double> FDoGWorkspace;
+typedef FDoGOptions_t<double> FDoGOptions;
+
+// The stages below are instantiated for float and double. The pipeline runs in float, which halves
+// the memory traffic of the tangent, DoG and flow planes; double is kept as the reference.
 
-void GaussSmoothSep(imatrix& image, double sigma);
+template<class T>
+void MakeGaussianVector(double sigma, myvec_t<T>& GAU);
+void MakeDoGKernelBank(double sigma, int bins, DoGKernelBank& bank);
+// Per-tap weights of the directional DoG's two Gaussians for s = -half_w2..half_w2 and their sums,
+// as DirectionalDoGRow and DoGKernelBank take them. w1 is zero beyond GAU1's half width.
+template<class T>
+void MakeDoGWeights(myvec_t<T>& GAU1, myvec_t<T>& GAU2, std::vector<float>& w1, std::vector<float>& w2,
+		float& w_sum1, float& w_sum2);
+template<class T>
+void GetDirectionalDoG(imatrix& image, ETF_t<T>& e, mymatrix_t<T>& dog, myvec_t<T>& GAU1, myvec_t<T>& GAU2, double tau);
+template<class T>
+void GetDirectionalDoGSIMD(imatrix& image, ETF_t<T>& e, mymatrix_t<T>& dog, myvec_t<T>& GAU1, myvec_t<T>& GAU2,
+		double tau, ThreadPool* threads = 0, FDoGWorkspace_t<T>* workspace = 0);
+template<class T>
+void GetDirectionalDoGQuantized(imatrix& image, ETF_t<T>& e, mymatrix_t<T>& dog, DoGKernelBank& bank, double tau,
+		ThreadPool* threads = 0, FDoGWorkspace_t<T>* workspace = 0);
+template<class T>
+void DirectionalDoGRow(const float* src, int src_r0, int src_c0, int src_stride, int image_x, int image_y, int i,
+		int col_begin, int col_end, const Vect_t<T>* e, T* dog, const float* w1, const float* w2, float w_sum1,
+		float w_sum2, int half_w2, double tau, myvec_t<T>& GAU1, myvec_t<T>& GAU2);
+template<class T>
+void GetFlowDoG(ETF_t<T>& e, mymatrix_t<T>& dog, mymatrix_t<T>& tmp, myvec_t<T>& GAU3);
+template<class T>
+void MakeFlowDoGMask(mymatrix_t<T>& dog, myvec_t<T>& GAU3, std::vector<unsigned char>& mask,
+		ThreadPool* threads = 0, FDoGWorkspace_t<T>* workspace = 0);
+template<class T>
+void FlowDoGRow(const FlowSample_t<T>* field, int field_r0, int field_c0, int field_stride, int image_x, int image_y,
+		int i, int col_begin, int col_end, myvec_t<T>& GAU3, const unsigned char* mask, T* out);
+template<class T>
+void GetFlowDoGInterleaved(ETF_t<T>& e, mymatrix_t<T>& dog, mymatrix_t<T>& tmp, myvec_t<T>& GAU3,
+		ThreadPool* threads = 0, FDoGWorkspace_t<T>* workspace = 0, const unsigned char* mask = 0);
+// Writes n line values (1 away from lines, down to 0 on them) as 8-bit with the threshold option
+// applied. V is int or unsigned char.
+template<class T, class V>
+void FDoGOutputRow(const T* line, int n, V* out, const FDoGOptions_t<T>& options);
+// The pieces of GaussSmoothSep, for separable blurs of other planes. MakeGaussTaps fills taps with
+// the normalised Gaussian of sigma, cut where MakeGaussianVector cuts it, and returns its half
+// width. GaussAccumulateRow is one tap of the vertical pass, acc += weight * src over n columns.
+// GaussPaddedRow is the horizontal pass over a row padded by half samples at both ends,
+// dst[j] = sum of w[s] * row[j + s] for s = 0..2 * half; into an int dst the sums are rounded.
+template<class T>
+int MakeGaussTaps(double sigma, std::vector<T>& taps);
+template<class S, class T>
+void GaussAccumulateRow(const S* src, T weight, T* acc, int n);
+template<class T, class D>
+void GaussPaddedRow(const T* row, D* dst, int n, const T* w, int half);
+template<class T = float>
+void GaussSmoothSep(imatrix& image, double sigma, ThreadPool* threads = 0, FDoGWorkspace_t<T>* workspace = 0);
 void ConstructMergedImage(imatrix& image, imatrix& gray, imatrix& merged);
 void ConstructMergedImageMult(imatrix& image, imatrix& gray, imatrix& merged);
-void GetFDoG(imatrix& image, ETF& e, double sigma, double sigma3, double tau);
+template<class T>
+void GetFDoG(imatrix& image, ETF_t<T>& e, double sigma, double sigma3, double tau,
+		const FDoGOptions_t<T>& options = FDoGOptions_t<T>());
+// Isotropic extended DoG (XDoG): the DoG of two separable Gaussian blurs at sigma and 1.6 * sigma,
+// with the tau of GetFDoG and its ramp, 1 where the DoG is positive and 1 + tanh below. There is no
+// tangent field and no streamline pass, so it costs a fraction of GetFDoG, at the price of lines that
+// are not smoothed along the edges. Samples outside the image are skipped as in the directional
+// DoG. The threshold options apply as in GetFDoG, angle_bins and sparse are unused.
+template<class T>
+void GetXDoG(imatrix& image, double sigma, double tau, const FDoGOptions_t<T>& options = FDoGOptions_t<T>());
 void Binarize(imatrix& image, double thres);
 void GrayThresholding(imatrix& image, double thres);
 
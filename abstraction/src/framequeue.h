@@ -0,0 +1,104 @@
+#ifndef _FRAMEQUEUE_H_
+#define _FRAMEQUEUE_H_
+
+#include <assert.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+// Bounded queue of items between two pipeline stages, one producer thread and one consumer thread.
+// The producer never waits: when the consumer falls behind, push() displaces the oldest item still
+// waiting instead of waiting for room, so a slow stage always works on recent frames and the
+// latency through the pipeline stays bounded. The ring holds atomic pointers and the producer and
+// the consumer exchange them, so each item is handed to exactly one side; the mutex is only taken
+// to put an idle consumer to sleep and wake it. T must have an unsigned member seq, which push()
+// sets to the item's position in the stream.
+template<class T, int N>
+class FrameQueue {
+private:
+	std::atomic<T*> slots[N];
+	std::atomic<unsigned> written; // items pushed so far
+	std::atomic<unsigned> dropped; // items displaced before the consumer took them
+	unsigned next; // consumer only, seq of the oldest item it has not yet passed
+	std::mutex lock; // guards closed and the consumer's sleep
+	std::condition_variable ready;
+	bool closed;
+public:
+	FrameQueue() :
+			written(0), dropped(0), next(0), closed(false) {
+		for (int k = 0; k < N; k++)
+			slots[k] = 0;
+	}
+
+	// Deletes the items still waiting. Neither side may be running.
+	~FrameQueue() {
+		for (int k = 0; k < N; k++)
+			delete slots[k].exchange(0);
+	}
+
+	// Producer only. Returns the item displaced to make room, or 0; the caller then owns it.
+	T* push(T* item) {
+		unsigned n = written.load(std::memory_order_relaxed);
+		item->seq = n;
+		T* old = slots[n % N].exchange(item, std::memory_order_acq_rel);
+		written.store(n + 1, std::memory_order_release);
+		if (old)
+			dropped++;
+		{
+			// under the lock, so the wake cannot fall between waitPop()'s check and its sleep
+			std::lock_guard<std::mutex> guard(lock);
+			ready.notify_one();
+		}
+		return old;
+	}
+
+	// Consumer only. Returns the oldest waiting item, or 0 if there is none. Items come out in
+	// increasing seq.
+	T* pop() {
+		// push() fills a slot before it publishes written, so the item at w may already have been
+		// taken and next be ahead of w: the differences are signed and next never moves back
+		unsigned w = written.load(std::memory_order_acquire);
+		while ((int) (w - next) > 0) {
+			// the items before w - N have all been displaced
+			if ((int) (w - next) > N)
+				next = w - N;
+			T* item = slots[next % N].exchange(0, std::memory_order_acq_rel);
+			if (!item) {
+				next++;
+				continue;
+			}
+			// a newer item may have displaced the one expected here, skip what lies before it
+			assert((int) (item->seq - next) >= 0);
+			next = item->seq + 1;
+			return item;
+		}
+		return 0;
+	}
+
+	// Consumer only. Returns the oldest waiting item, sleeping until one is pushed if there is none.
+	// Returns 0 once close() has been called.
+	T* waitPop() {
+		T* item;
+		while (!(item = pop())) {
+			std::unique_lock<std::mutex> guard(lock);
+			if (closed)
+				return 0;
+			if ((int) (written.load(std::memory_order_acquire) - next) <= 0)
+				ready.wait(guard);
+		}
+		return item;
+	}
+
+	// Wakes the consumer for good, waitPop() returns 0 from now on. Any thread.
+	void close() {
+		std::lock_guard<std::mutex> guard(lock);
+		closed = true;
+		ready.notify_all();
+	}
+
+	unsigned getDropped() const {
+		return dropped;
+	}
+};
+
+#endif
@@ -0,0 +1,56 @@
+#include "lumapath.h"
+
+using namespace cv;
+
+// Coefficients of OpenCV's RGB2YCrCb_i and YCrCb2RGB_i, in units of 2^-14.
+#define LUMA_SHIFT 14
+#define LUMA_R2Y 4899
+#define LUMA_G2Y 9617
+#define LUMA_B2Y 1868
+#define LUMA_R2CR 11682
+#define LUMA_B2CB 9241
+#define LUMA_CR2R 22987
+#define LUMA_CR2G -11698
+#define LUMA_CB2G -5636
+#define LUMA_CB2B 29049
+#define LUMA_DESCALE(x) (((x) + (1 << (LUMA_SHIFT - 1))) >> LUMA_SHIFT)
+
+static inline unsigned char Clamp8(int v) {
+	return (unsigned char) ((v < 0) ? 0 : (v > 255) ? 255 : v);
+}
+
+void ExtractLuma(const Mat& frame, Mat& y) {
+	CV_Assert(frame.type() == CV_8UC3);
+	y.create(frame.rows, frame.cols, CV_8UC1);
+	for (int i = 0; i < frame.rows; i++) {
+		const unsigned char* src = frame.ptr<unsigned char>(i);
+		unsigned char* dst = y.ptr<unsigned char>(i);
+		for (int j = 0; j < frame.cols; j++, src += 3)
+			dst[j] = Clamp8(LUMA_DESCALE(src[0] * LUMA_R2Y + src[1] * LUMA_G2Y + src[2] * LUMA_B2Y));
+	}
+}
+
+void ReplaceLuma(const Mat& frame, const Mat& y, Mat& out, const Mat& lines, int line_level) {
+	CV_Assert(frame.type() == CV_8UC3 && y.type() == CV_8UC1 && y.size() == frame.size());
+	CV_Assert(lines.empty() || (lines.type() == CV_8UC1 && lines.size() == frame.size()));
+	out.create(frame.rows, frame.cols, CV_8UC3);
+	const int delta = 128 << LUMA_SHIFT;
+
+	for (int i = 0; i < frame.rows; i++) {
+		const unsigned char* src = frame.ptr<unsigned char>(i);
+		const unsigned char* luma = y.ptr<unsigned char>(i);
+		const unsigned char* line = lines.empty() ? 0 : lines.ptr<unsigned char>(i);
+		unsigned char* dst = out.ptr<unsigned char>(i);
+		for (int j = 0; j < frame.cols; j++, src += 3, dst += 3) {
+			// the chroma the forward conversion gives the original pixel, saturated as it would be stored
+			int Y0 = LUMA_DESCALE(src[0] * LUMA_R2Y + src[1] * LUMA_G2Y + src[2] * LUMA_B2Y);
+			int Cr = Clamp8(LUMA_DESCALE((src[0] - Y0) * LUMA_R2CR + delta)) - 128;
+			int Cb = Clamp8(LUMA_DESCALE((src[2] - Y0) * LUMA_B2CB + delta)) - 128;
+
+			int Y = (line && line[j] <= line_level) ? 0 : luma[j];
+			dst[0] = Clamp8(Y + LUMA_DESCALE(Cr * LUMA_CR2R));
+			dst[1] = Clamp8(Y + LUMA_DESCALE(Cb * LUMA_CB2G + Cr * LUMA_CR2G));
+			dst[2] = Clamp8(Y + LUMA_DESCALE(Cb * LUMA_CB2B));
+		}
+	}
+}
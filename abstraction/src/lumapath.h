@@ -0,0 +1,23 @@
+#ifndef _LUMAPATH_H_
+#define _LUMAPATH_H_
+
+#include <opencv2/core/core.hpp>
+
+// The colour ends of the abstraction, which only ever processes luma. Instead of converting the
+// whole frame to YCrCb, splitting it, merging the processed Y back and converting to RGB again, the
+// front end writes Y alone and the back end recomputes the chroma from the original frame and
+// converts straight to RGB: two passes over the frame instead of five, no three-channel temporaries.
+// Both use the fixed-point arithmetic of OpenCV's 8-bit CV_RGB2YCrCb and CV_YCrCb2RGB, with the
+// same channel order, so the result is the same to the bit.
+
+// y = the Y plane of CV_RGB2YCrCb on the 8-bit three-channel frame. y is reallocated only when the
+// frame size changes.
+void ExtractLuma(const cv::Mat& frame, cv::Mat& y);
+
+// out = CV_YCrCb2RGB of the frame's own Cr and Cb with y as luma. Where lines is given, luma is
+// taken as 0 wherever the line value is at most line_level, the merge of the CLD lines folded into
+// the same pass.
+void ReplaceLuma(const cv::Mat& frame, const cv::Mat& y, cv::Mat& out, const cv::Mat& lines = cv::Mat(),
+		int line_level = 0);
+
+#endif
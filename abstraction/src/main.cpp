@@ -1,8 +1,14 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include <iostream>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <tuple>
+#include <vector>
 
 #include <opencv2/objdetect/objdetect.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -15,6 +21,14 @@
 #include "cld/imatrix.h"
 #include "cld/ETF.h"
 #include "cld/fdog.h"
+#include "cld/threadpool.h"
+#include "cld/cldcontext.h"
+#include "cld/fastmath.h"
+#include "stagecache.h"
+#include "quantization.h"
+#include "lumapath.h"
+#include "framequeue.h"
+#include "cld/cldbatch.h"
 
 using namespace std;
 using namespace cv;
@@ -25,17 +39,160 @@ using namespace cv;
 
 int quantLevel = 4;
 int bilatFilterSize = 1;
+// tanh-smoothed quantisation steps instead of hard ones
+bool softQuant = false;
+// CLD buffers kept between frames and trackbar updates
+CldContext cldContext;
+
+// Float results of the bilateral filter for the last few (frame id, radius, range std). Both
+// consumers in runComputations read the same entry, and going back to a filter size that was used
+// on the current frame does not filter again. In video mode every frame has a new id, so the
+// entries of old frames are simply the first to be replaced.
+#define BILAT_CACHE_SIZE 4
+struct BilateralCache {
+	struct Entry {
+		unsigned frameId;
+		int radius;
+		float rangeStd;
+		unsigned lastUse; // 0 for an empty entry
+		Mat result;
+	};
+	Entry entries[BILAT_CACHE_SIZE];
+	int size; // entries in use, at most BILAT_CACHE_SIZE
+	unsigned clock;
+
+	BilateralCache(int size = BILAT_CACHE_SIZE) :
+			size((size >= 1 && size <= BILAT_CACHE_SIZE) ? size : BILAT_CACHE_SIZE), clock(0) {
+		for (int k = 0; k < BILAT_CACHE_SIZE; k++)
+			entries[k].lastUse = 0;
+	}
+
+	// Returns the CV_32FC1 bilateral result of input, which must be the frame frameId identifies.
+	const Mat& get(unsigned frameId, const Mat& input, int radius, float rangeStd);
+};
+BilateralCache bilatCache;
+
+// Stage outputs of runComputations, kept between calls so that moving a trackbar only reruns the
+// stages downstream of its parameter: the quantisation level reruns quantize and the merge, the
+// filter size everything after the colour conversion. A new frame id reruns everything.
+struct AbstractionGraph {
+	Stage<tuple<unsigned> > color; // frame id
+	Mat frame; // the caller's image, the back end takes its chroma
+	Mat luma;
+	Stage<tuple<unsigned, int, float> > bilat; // color, radius, range std
+	Mat bilatResult; // CV_32FC1, shared with bilatCache
+	Stage<tuple<unsigned> > cldBilat; // bilat
+	Mat cldInput;
+	Stage<tuple<unsigned> > lines; // cldBilat
+	Mat lineImage;
+	Stage<tuple<int, bool> > quantTable; // quantisation level, soft
+	Mat quantLUT;
+	Stage<tuple<unsigned, unsigned, bool, float, unsigned> > quant; // bilat, cldBilat, filterTwice, alpha, quantTable
+	Mat quantized;
+	Stage<tuple<unsigned, unsigned> > output; // quant, lines
+	Mat result;
+};
+AbstractionGraph graph;
+
+// The webcam mode runs capture, colour conversion plus bilateral filter and quantisation, CLD,
+// compositing and display on their own threads, connected by FrameQueues. Frames overtaken by
+// newer ones are dropped, so the frame rate approaches that of the slowest stage.
+#define PIPE_CAPTURE 0
+#define PIPE_FILTER 1
+#define PIPE_LINES 2
+#define PIPE_COMPOSITE 3
+#define PIPE_DISPLAY 4
+#define PIPE_STAGES 5
+#define PIPE_QUEUE_SIZE 2
+#define PIPE_REPORT_FRAMES 100 // frames between latency reports
+
+// One webcam frame on its way through the pipeline. A stage owns it from popping it until pushing
+// it on, so the fields need no locking.
+struct VideoFrame {
+	unsigned seq; // position in the current queue, set by FrameQueue::push
+	unsigned id; // capture order, the bilateral cache key
+	Mat rgb;
+	Mat luma;
+	Mat cldInput, quantized, lines, result;
+	chrono::steady_clock::time_point captured;
+	double work[PIPE_STAGES]; // ms each stage spent on the frame
+};
+typedef FrameQueue<VideoFrame, PIPE_QUEUE_SIZE> VideoQueue;
 
 void update();
-Mat runComputations(Mat originalFrame, int bilatFilterSize = 5, int quantizationLevel = 7, bool filterTwice = true, float bilatAlpha = 255);
+// frameId identifies originalFrame: calls with the same id must pass the same image.
+Mat runComputations(Mat originalFrame, unsigned frameId, int bilatFilterSize = 5, int quantizationLevel = 7, bool filterTwice = true,
+		float bilatAlpha = 255);
+// The same on a graph, CLD context and bilateral cache of the caller's instead of the globals.
+Mat runComputations(AbstractionGraph& g, CldContext& context, BilateralCache& cache, Mat originalFrame, unsigned frameId,
+		int bilatFilterSize, int quantizationLevel, bool filterTwice = true, float bilatAlpha = 255);
 Mat runBilteralFilter(Mat input, int spatialRadius, float rangeStd);
-void convertToKangMatrix(Mat frame, imatrix& img);
-void convertFromKangMatrix(Mat& frame, imatrix img);
-void runCLDWork(imatrix& img);
-void quantize(Mat& image, int quadrants);
+void drawLines(CldContext& context, const Mat& cldInput, Mat& lines);
+void makeQuantTable(int quantizationLevel, bool soft, Mat& lut);
+void compositeFrame(const Mat& frame, const Mat& quantized, const Mat& lines, Mat& result);
+void convertToKangMatrix(Mat frame, CldContext& context);
+void convertFromKangMatrix(Mat& frame, imatrix& img);
+void runCLDWork(CldContext& context);
 void updateCallback(int, void*);
+void runVideoPipeline(CvCapture* capture);
+int runBatch(const char* input, const char* output, int jobs, bool threadsSet);
+int runQueueStress(unsigned count);
+
+int main(int argc, char** argv) {
+	const char* batchInput = 0;
+	const char* batchOutput = 0;
+	int batchJobs = 0;
+	bool threadsSet = false;
+
+	for (int i = 1; i < argc; i++) {
+		// --threads N sets how many threads the CLD stages use, defaults to one per hardware thread.
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			ThreadPool::setSharedThreads(atoi(argv[++i]));
+			threadsSet = true;
+		}
+		// --etf-scale 2|4 builds the tangent field at half or quarter resolution.
+		if (strcmp(argv[i], "--etf-scale") == 0 && i + 1 < argc) {
+			if (!cldContext.setETFScale(atoi(argv[++i]))) {
+				cerr << "--etf-scale must be 1, 2 or 4, not " << argv[i] << endl;
+				return 1;
+			}
+		}
+		// --xdog swaps the FDoG for the cheaper isotropic XDoG, for previews and slow machines.
+		if (strcmp(argv[i], "--xdog") == 0) {
+			cldContext.setEdgeMode(CLD_EDGES_XDOG);
+		}
+		// --fast-math uses the polynomial tanh and reciprocal square root of fastmath.h.
+		if (strcmp(argv[i], "--fast-math") == 0) {
+			SetFastMath(true);
+		}
+		// --soft-quant smooths the quantisation steps with tanh, see quantization.h.
+		if (strcmp(argv[i], "--soft-quant") == 0) {
+			softQuant = true;
+		}
+		// --tensor-etf builds the tangent field from the smoothed structure tensor.
+		if (strcmp(argv[i], "--tensor-etf") == 0) {
+			cldContext.setETFMode(CLD_ETF_TENSOR);
+		}
+		// --batch IN OUT abstracts every image in the directory or list file IN into the directory
+		// OUT without opening a window, see RunBatch, and exits.
+		if (strcmp(argv[i], "--batch") == 0 && i + 2 < argc) {
+			batchInput = argv[++i];
+			batchOutput = argv[++i];
+		}
+		// --jobs N processes N batch images at a time, defaults to one per hardware thread.
+		if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+			batchJobs = atoi(argv[++i]);
+		}
+		// --stress-queue N pushes N items through the video pipeline's FrameQueue between two
+		// threads, checks that they arrive in order and exits.
+		if (strcmp(argv[i], "--stress-queue") == 0 && i + 1 < argc) {
+			return runQueueStress((unsigned) atoi(argv[++i]));
+		}
+	}
 
-int main() {
+	if (batchInput) {
+		return runBatch(batchInput, batchOutput, batchJobs, threadsSet);
+	}
 
 	if (SHOW_CONTROLS) {
 		namedWindow("Control", CV_WINDOW_AUTOSIZE);
@@ -58,17 +215,17 @@ void update() {
 		capture = cvCaptureFromCAM(0);
 		cvSetCaptureProperty(capture, CV_CAP_PROP_FRAME_WIDTH, 320);
 		cvSetCaptureProperty(capture, CV_CAP_PROP_FRAME_HEIGHT, 240);
+		// consecutive frames have nearly the same tangent field, start each one from the last
+		cldContext.setTemporal(true);
 
-		while (true) {
-			Mat originalFrame = cvQueryFrame(capture);
-			imshow("Output Image", runComputations(originalFrame, bilatFilterSize, quantLevel));
-			waitKey(10);
-		}
+		runVideoPipeline(capture);
+		cvReleaseCapture(&capture);
 	} else {
 		namedWindow("Output Image", CV_WINDOW_AUTOSIZE | CV_WINDOW_KEEPRATIO | CV_GUI_EXPANDED);
 
-		Mat originalFrame = imread("C:\\Users\\David Wood\\Pictures\\input.jpg");
-		Mat outputFrame = runComputations(originalFrame, bilatFilterSize, quantLevel);
+		// read once, the trackbar updates reuse the image and its cached stages
+		static Mat originalFrame = imread("C:\\Users\\David Wood\\Pictures\\input.jpg");
+		Mat outputFrame = runComputations(originalFrame, 1, bilatFilterSize, quantLevel);
 		imshow("Output Image", outputFrame);
 		if (SAVE_IMAGE) {
 			imwrite("C:\\Users\\David Wood\\Pictures\\abstraction.jpg", outputFrame);
@@ -76,90 +233,326 @@ void update() {
 	}
 }
 
-Mat runComputations(Mat originalFrame, int bilatFilterSize, int quantizationLevel, bool filterTwice, float bilatAlpha) {
-	Mat yCrCbFrame;
-	cvtColor(originalFrame, yCrCbFrame, CV_RGB2YCrCb);
+Mat runComputations(Mat originalFrame, unsigned frameId, int bilatFilterSize, int quantizationLevel, bool filterTwice,
+		float bilatAlpha) {
+	return runComputations(graph, cldContext, bilatCache, originalFrame, frameId, bilatFilterSize, quantizationLevel,
+			filterTwice, bilatAlpha);
+}
 
-	// Split into channels.
-	Mat yCh[3];
-	split(yCrCbFrame, yCh);
+Mat runComputations(AbstractionGraph& g, CldContext& context, BilateralCache& cache, Mat originalFrame, unsigned frameId,
+		int bilatFilterSize, int quantizationLevel, bool filterTwice, float bilatAlpha) {
 
-	// Running the bilateral filter.
-	Mat postBilat = runBilteralFilter(yCh[0], bilatFilterSize, bilatFilterSize);
-	// Bilat filter converts to 32F depth, this changes back to 8U
-	postBilat.convertTo(postBilat, CV_8UC1, 180);
+	if (g.color.needs(make_tuple(frameId))) {
+		g.frame = originalFrame;
+		ExtractLuma(originalFrame, g.luma);
+	}
 
-	// Kang-ing the bilateral filtered frame.
-	Mat postKang;
-	imatrix img;
-	convertToKangMatrix(postBilat, img);
-	runCLDWork(img);
-	convertFromKangMatrix(postKang, img);
+	// Running the bilateral filter. The CLD and the quantisation read the same float result and
+	// differ only in how they scale it back to 8U.
+	float rangeStd = (float) bilatFilterSize;
+	if (g.bilat.needs(make_tuple(g.color.getVersion(), bilatFilterSize, rangeStd))) {
+		g.bilatResult = cache.get(frameId, g.luma, bilatFilterSize, rangeStd);
+	}
 
-	if (filterTwice) {
-		// Running the bilateral filter.
-		postBilat = runBilteralFilter(yCh[0], bilatFilterSize, bilatFilterSize);
-		// Bilat filter converts to 32F depth, this changes back to 8U
-		postBilat.convertTo(postBilat, CV_8UC1, bilatAlpha);
+	// From here the CLD branch (8-bit conversion, Kang conversion, lines) and the quantisation
+	// branch only meet in the composite. The keys are checked up front, then the stale branches run
+	// as two tasks on the shared pool. Without filterTwice the quantisation reads the CLD input and
+	// has to wait for it.
+	bool newCldInput = g.cldBilat.needs(make_tuple(g.bilat.getVersion()));
+	bool newLines = g.lines.needs(make_tuple(g.cldBilat.getVersion()));
+	if (g.quantTable.needs(make_tuple(quantizationLevel, softQuant))) {
+		makeQuantTable(quantizationLevel, softQuant, g.quantLUT);
 	}
+	bool newQuant = g.quant.needs(make_tuple(g.bilat.getVersion(), g.cldBilat.getVersion(), filterTwice, bilatAlpha,
+			g.quantTable.getVersion()));
 
-	// Quantize.
-	Mat postQuant = postBilat.clone();
-	quantize(postQuant, quantizationLevel);
+	auto cldBranch = [&] {
+		if (newCldInput) {
+			// Bilat filter converts to 32F depth, this changes back to 8U
+			g.bilatResult.convertTo(g.cldInput, CV_8UC1, 180);
+		}
+		// Kang-ing the bilateral filtered frame.
+		if (newLines) {
+			drawLines(context, g.cldInput, g.lineImage);
+		}
+	};
+	// Quantize. With filterTwice the table lookup is fused into the conversion of the bilateral
+	// result, otherwise it reads the CLD input.
+	auto quantBranch = [&] {
+		if (!newQuant)
+			return;
+		if (filterTwice)
+			ConvertQuantized(g.bilatResult, g.quantized, bilatAlpha, g.quantLUT);
+		else
+			LUT(g.cldInput, g.quantLUT, g.quantized);
+	};
+	if (newLines && newQuant && filterTwice) {
+		ThreadPool::shared().parallelInvoke(cldBranch, quantBranch);
+	} else {
+		cldBranch();
+		quantBranch();
+	}
+
+	if (g.output.needs(make_tuple(g.quant.getVersion(), g.lines.getVersion()))) {
+		compositeFrame(g.frame, g.quantized, g.lineImage, g.result);
+	}
+	return g.result;
+}
+
+// Batch worker for the abstraction. Each has its own graph and CLD context, set up like the global
+// one from the command line, and a one-entry bilateral cache: every image is new, more entries
+// would only hold on to memory.
+class AbstractionBatchWorker: public BatchWorker {
+private:
+	AbstractionGraph graph;
+	CldContext context;
+	BilateralCache cache;
+	unsigned frameId;
+public:
+	AbstractionBatchWorker() :
+			cache(1), frameId(0) {
+		context.setETFScale(cldContext.getETFScale());
+		context.setEdgeMode(cldContext.getEdgeMode());
+		context.setETFMode(cldContext.getETFMode());
+	}
+
+	bool process(const Mat& input, Mat& output) {
+		// the CLD needs a 3 x 3 neighbourhood
+		if (input.rows < 3 || input.cols < 3)
+			return false;
+		output = runComputations(graph, context, cache, input, ++frameId, bilatFilterSize, quantLevel);
+		return true;
+	}
+};
 
-	// Removing the white, from the Kang'd image; The cols and rows may seem the wrong way around - they aren't.
-	Mat mask, allBlack = Mat::zeros(Size(postKang.cols, postKang.rows), CV_8UC1);
-	inRange(postKang, Scalar(0, 0, 0), Scalar(80, 80, 80), mask);
-	// Merges the frames by copying all non-zero elements from an all black image where the mask is to postQuant
-	allBlack.copyTo(postQuant, mask);
+int runBatch(const char* input, const char* output, int jobs, bool threadsSet) {
+	vector<string> paths;
+	if (!ListBatchInputs(input, paths)) {
+		cerr << "Could not read " << input << endl;
+		return 1;
+	}
+	if (jobs < 1) {
+		jobs = (int) thread::hardware_concurrency();
+		if (jobs < 1)
+			jobs = 1;
+	}
+	// images run in parallel already, splitting each one into bands as well only adds contention
+	if (!threadsSet) {
+		ThreadPool::setSharedThreads(1);
+	}
 
-	// Join the old CrCb channels with the Y channel.
-	Mat finishedFrame = Mat(Size(postQuant.rows, postQuant.cols), CV_8UC3);
-	yCh[0] = postQuant;
-	// Channels must have same size and depth. 2nd parameter must be equal to total no. of channels in yCh.
-	merge(yCh, 3, finishedFrame);
+	vector<AbstractionBatchWorker> workers(jobs);
+	vector<BatchWorker*> pointers;
+	for (int k = 0; k < jobs; k++)
+		pointers.push_back(&workers[k]);
+	return RunBatch(paths, output, pointers) ? 1 : 0;
+}
 
-	//Convert back to RGB.
-	Mat finishedRGBFrame;
-	cvtColor(finishedFrame, finishedRGBFrame, CV_YCrCb2RGB);
-	return finishedRGBFrame;
+static double msSince(chrono::steady_clock::time_point t0) {
+	return chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+}
+
+// Applies work to every frame arriving on in and passes it on to out, until in is closed.
+template<class F>
+static void runVideoStage(VideoQueue& in, VideoQueue& out, int stage, F work) {
+	while (VideoFrame* frame = in.waitPop()) {
+		chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+		work(*frame);
+		frame->work[stage] = msSince(t0);
+		delete out.push(frame);
+	}
+}
+
+struct StressItem {
+	unsigned seq;
+};
+
+// The producer pushes as fast as it can, so most items are displaced; those that arrive must still
+// arrive in increasing seq, or the video would step backwards. Returns 1 if any did not.
+int runQueueStress(unsigned count) {
+	FrameQueue<StressItem, PIPE_QUEUE_SIZE> queue;
+	thread producer([&] {
+		for (unsigned k = 0; k < count; k++)
+			delete queue.push(new StressItem);
+		queue.close();
+	});
+
+	unsigned received = 0, backwards = 0;
+	bool first = true;
+	unsigned last = 0;
+	while (StressItem* item = queue.waitPop()) {
+		if (!first && (int) (item->seq - last) <= 0)
+			backwards++;
+		first = false;
+		last = item->seq;
+		received++;
+		delete item;
+	}
+	producer.join();
+
+	printf("%u pushed, %u received, %u dropped, %u out of order\n", count, received, queue.getDropped(), backwards);
+	return backwards ? 1 : 0;
+}
+
+void runVideoPipeline(CvCapture* capture) {
+	VideoQueue captured, filtered, drawn, composited;
+	atomic<bool> running(true);
+
+	thread captureThread([&] {
+		for (unsigned id = 1; running; id++) {
+			chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+			IplImage* image = cvQueryFrame(capture);
+			if (!image)
+				break;
+			VideoFrame* frame = new VideoFrame;
+			frame->id = id;
+			frame->captured = t0;
+			// cvQueryFrame reuses its buffer for the next frame
+			frame->rgb = Mat(image, true);
+			frame->work[PIPE_CAPTURE] = msSince(t0);
+			delete captured.push(frame);
+		}
+	});
+
+	// The trackbars write bilatFilterSize and quantLevel on this thread, from inside waitKey; the
+	// display loop copies them here after each waitKey for the filter thread to read.
+	atomic<int> filterSize(bilatFilterSize), filterLevel(quantLevel);
+
+	// the quantisation table is rebuilt when the trackbar or the mode changes
+	Stage<tuple<int, bool> > quantTable;
+	Mat quantLUT;
+	thread filterThread([&] {
+		runVideoStage(captured, filtered, PIPE_FILTER, [&](VideoFrame& frame) {
+			// the trackbars may move while the frame is processed, read them once
+			int size = filterSize;
+			int level = filterLevel;
+			ExtractLuma(frame.rgb, frame.luma);
+			Mat bilat = bilatCache.get(frame.id, frame.luma, size, (float) size);
+			bilat.convertTo(frame.cldInput, CV_8UC1, 180);
+			if (quantTable.needs(make_tuple(level, softQuant)))
+				makeQuantTable(level, softQuant, quantLUT);
+			ConvertQuantized(bilat, frame.quantized, 255, quantLUT);
+		});
+	});
+	thread linesThread([&] {
+		runVideoStage(filtered, drawn, PIPE_LINES, [&](VideoFrame& frame) {
+			drawLines(cldContext, frame.cldInput, frame.lines);
+		});
+	});
+	thread compositeThread([&] {
+		runVideoStage(drawn, composited, PIPE_COMPOSITE, [&](VideoFrame& frame) {
+			compositeFrame(frame.rgb, frame.quantized, frame.lines, frame.result);
+		});
+	});
+
+	// Display stays on this thread, highgui windows belong to the thread that created them.
+	double work[PIPE_STAGES] = { 0 };
+	double latency = 0.0;
+	int shown = 0;
+	chrono::steady_clock::time_point reportStart = chrono::steady_clock::now();
+	while (true) {
+		VideoFrame* frame = composited.pop();
+		if (frame) {
+			chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+			imshow("Output Image", frame->result);
+			frame->work[PIPE_DISPLAY] = msSince(t0);
+			for (int k = 0; k < PIPE_STAGES; k++)
+				work[k] += frame->work[k];
+			latency += msSince(frame->captured);
+			delete frame;
+
+			if (++shown == PIPE_REPORT_FRAMES) {
+				printf("%.1f fps, latency %.1f ms; capture %.1f, filter %.1f, lines %.1f, composite %.1f, "
+						"display %.1f ms; dropped %u/%u/%u/%u\n", shown * 1000.0 / msSince(reportStart), latency / shown,
+						work[PIPE_CAPTURE] / shown, work[PIPE_FILTER] / shown, work[PIPE_LINES] / shown,
+						work[PIPE_COMPOSITE] / shown, work[PIPE_DISPLAY] / shown, captured.getDropped(),
+						filtered.getDropped(), drawn.getDropped(), composited.getDropped());
+				for (int k = 0; k < PIPE_STAGES; k++)
+					work[k] = 0.0;
+				latency = 0.0;
+				shown = 0;
+				reportStart = chrono::steady_clock::now();
+			}
+		}
+		// also runs the window's event loop, Esc ends the video
+		if (waitKey(1) == 27)
+			break;
+		filterSize = bilatFilterSize;
+		filterLevel = quantLevel;
+	}
+
+	running = false;
+	captured.close();
+	filtered.close();
+	drawn.close();
+	captureThread.join();
+	filterThread.join();
+	linesThread.join();
+	compositeThread.join();
+}
+
+void drawLines(CldContext& context, const Mat& cldInput, Mat& lines) {
+	convertToKangMatrix(cldInput, context);
+	runCLDWork(context);
+	convertFromKangMatrix(lines, context.image);
+}
+
+void makeQuantTable(int quantizationLevel, bool soft, Mat& lut) {
+	if (soft)
+		MakeSoftQuantLUT(quantizationLevel, QUANT_SOFT_PHI, lut);
+	else
+		MakeQuantLUT(quantizationLevel, lut);
+}
+
+void compositeFrame(const Mat& frame, const Mat& quantized, const Mat& lines, Mat& result) {
+	// The quantised luma with the original chroma, back to RGB. Pixels whose line value is at most
+	// 80 are set to black on the way.
+	ReplaceLuma(frame, quantized, result, lines, 80);
+}
+
+const Mat& BilateralCache::get(unsigned frameId, const Mat& input, int radius, float rangeStd) {
+	Entry* slot = &entries[0];
+	clock++;
+	for (int k = 0; k < size; k++) {
+		Entry& e = entries[k];
+		if (e.lastUse && e.frameId == frameId && e.radius == radius && e.rangeStd == rangeStd) {
+			e.lastUse = clock;
+			return e.result;
+		}
+		if (e.lastUse < slot->lastUse)
+			slot = &e;
+	}
+	slot->frameId = frameId;
+	slot->radius = radius;
+	slot->rangeStd = rangeStd;
+	slot->lastUse = clock;
+	slot->result = runBilteralFilter(input, radius, rangeStd);
+	return slot->result;
 }
 
 Mat runBilteralFilter(Mat input, int spatialRadius, float rangeStd) {
-	int height, width, step;
-	int i, j;
-	float *data2;
+	int height, width;
+	int i;
 
 	int nc = ceil(1.f / rangeStd); // number of coeffs. to use
 
-	// load a grayscale image
-	Mat* img = &input;
-
 	// get the image data
-	height = (*img).rows;
-	width = (*img).cols;
-	step = (*img).step;
+	height = input.rows;
+	width = input.cols;
 
-	uchar *imdata = (uchar *) (*img).data;
-
-	uchar *data = new uchar[height * width];
+	vector<uchar> data(height * width);
 	for (i = 0; i < height; i++) {
-		for (j = 0; j < width; j++) {
-			data[i * width + j] = imdata[i * step + j];
-		}
+		memcpy(&data[i * width], input.ptr<uchar>(i), width);
 	}
 
 	// result image
-	Mat fimg2WithoutTheDamnPointers = Mat(Size(width, height), CV_32FC1, 1);
-	Mat *fimg2 = &fimg2WithoutTheDamnPointers;
-	//cvSet(fimg2, cvScalar(0));
-	data2 = (float *) (*fimg2).data;
+	Mat result(Size(width, height), CV_32FC1);
 
 	int hw = height * width;
 
 	// auxiliary images
-	float *II = new float[hw]; // integral image
-	float *W = new float[hw]; // Normalisation factor for each window (sum of weights)
+	vector<float> II(hw); // integral image
+	vector<float> W(hw); // Normalisation factor for each window (sum of weights)
 
 	rangeStd *= (EE_MAX_IM_RANGE - 1);
 	float dctc[EE_MAX_IM_RANGE];
@@ -172,13 +565,14 @@ Mat runBilteralFilter(Mat input, int spatialRadius, float rangeStd) {
 	dct(G, D);
 	dctc[0] /= sqrt(2); // for the inverse computation
 
-	ciiBF(data, data2, dctc, II, W, height, width, nc, spatialRadius);
+	ciiBF(&data[0], (float *) result.data, dctc, &II[0], &W[0], height, width, nc, spatialRadius);
 
-	return (*fimg2);
+	return result;
 }
 
-void convertToKangMatrix(Mat frame, imatrix& img) {
-	img.init(frame.rows, frame.cols);
+void convertToKangMatrix(Mat frame, CldContext& context) {
+	context.prepare(frame.rows, frame.cols);
+	imatrix& img = context.image;
 	for (int y = 0; y < frame.rows; y++) {
 		for (int x = 0; x < frame.cols; x++) {
 			img[y][x] = frame.at<unsigned char>(y, x);
@@ -186,8 +580,8 @@ void convertToKangMatrix(Mat frame, imatrix& img) {
 	}
 }
 
-void convertFromKangMatrix(Mat& frame, imatrix img) {
-	frame = Mat(Size(img.getCol(), img.getRow()), CV_8UC1);
+void convertFromKangMatrix(Mat& frame, imatrix& img) {
+	frame.create(img.getRow(), img.getCol(), CV_8UC1);
 	for (int y = 0; y < img.getRow(); y++) {
 		for (int x = 0; x < img.getCol(); x++) {
 			frame.at<unsigned char>(y, x) = img[y][x];
@@ -195,50 +589,15 @@ void convertFromKangMatrix(Mat& frame, imatrix img) {
 	}
 }
 
-void runCLDWork(imatrix& img) {
-	// We assume that you have loaded your input image into an imatrix named "img"
-	int image_x = img.getRow();
-	int image_y = img.getCol();
-
-	ETF e;
-	e.init(image_x, image_y);
-	e.set2(img); // get gradients from gradient map
-	e.Smooth(4, 2);
-
+void runCLDWork(CldContext& context) {
+	// We assume that you have loaded your input image into context.image
 	double tao = 0.99;
 	double thres = 0.7;
-	GetFDoG(img, e, 1.0, 3.0, tao);
-	GrayThresholding(img, thres);
-}
-
-void quantize(Mat& image, int quadrants = 8) {
-	int step = floor(255 / quadrants - 1);
-	int rem = 255 - (step * quadrants - 1);
-
-	for (int j = 0; j < image.rows; j++) {
-		for (int i = 0; i < image.cols; i++) {
-			uchar data = image.ptr<uchar>(j)[i];
-
-			for (int k = 0; k < quadrants; k++) {
-				int lbound = (k * step);
-				int ubound = ((k + 1) * step);
-
-				if (data >= lbound && data < ubound) {
-					data = ubound;
-					break;
-				}
-			}
-			if (rem != 0) {
-				if (data >= (255 - rem) && data < 255) {
-					data = 255;
-				}
-			}
-
-			image.at<unsigned char>(j, i) = data;
-		}
-	}
+	context.run(1.0, 3.0, tao, thres);
 }
 
 void updateCallback(int, void*) {
-	update();
+	// the video loop reads the trackbar values itself on its next frame
+	if (!USE_VIDEO)
+		update();
 }
@@ -0,0 +1,81 @@
+#include <math.h>
+
+#include "quantization.h"
+
+// SSE2 is always available on x64 and on x86 builds with /arch:SSE2 or -msse2.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define QUANT_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+using namespace cv;
+
+void MakeQuantLUT(int levels, Mat& lut) {
+	if (levels < 1)
+		levels = 1;
+	lut.create(1, 256, CV_8UC1);
+	unsigned char* table = lut.ptr<unsigned char>(0);
+
+	int step = 255 / levels - 1;
+	int rem = 255 - (step * levels - 1);
+	for (int v = 0; v < 256; v++) {
+		int data = v;
+		for (int k = 0; k < levels; k++) {
+			int lbound = k * step;
+			int ubound = (k + 1) * step;
+			if (data >= lbound && data < ubound) {
+				data = ubound;
+				break;
+			}
+		}
+		if (rem != 0 && data >= 255 - rem && data < 255)
+			data = 255;
+		table[v] = (unsigned char) data;
+	}
+}
+
+void MakeSoftQuantLUT(int levels, double phi, Mat& lut) {
+	if (levels < 1)
+		levels = 1;
+	lut.create(1, 256, CV_8UC1);
+	unsigned char* table = lut.ptr<unsigned char>(0);
+
+	double dq = 255.0 / levels;
+	// phi is given per unit of luminance on the paper's 0..100 scale
+	double sharpness = phi * 100.0 / 255.0;
+	for (int v = 0; v < 256; v++) {
+		double nearest = floor(v / dq + 0.5) * dq;
+		double q = nearest + dq / 2.0 * tanh(sharpness * (v - nearest));
+		table[v] = saturate_cast<uchar>(q);
+	}
+}
+
+void ConvertQuantized(const Mat& src, Mat& dst, double alpha, const Mat& lut) {
+	CV_Assert(src.type() == CV_32FC1 && lut.total() == 256 && lut.type() == CV_8UC1);
+	dst.create(src.rows, src.cols, CV_8UC1);
+	const unsigned char* table = lut.ptr<unsigned char>(0);
+	// convertTo scales 32F in float, round to nearest even, then saturates
+	float a = (float) alpha;
+
+	for (int y = 0; y < src.rows; y++) {
+		const float* s = src.ptr<float>(y);
+		unsigned char* d = dst.ptr<unsigned char>(y);
+		int x = 0;
+#ifdef QUANT_USE_SSE2
+		__m128 va = _mm_set1_ps(a);
+		unsigned char bytes[16];
+		for (; x + 16 <= src.cols; x += 16) {
+			__m128i i0 = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(s + x), va));
+			__m128i i1 = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(s + x + 4), va));
+			__m128i i2 = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(s + x + 8), va));
+			__m128i i3 = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(s + x + 12), va));
+			__m128i packed = _mm_packus_epi16(_mm_packs_epi32(i0, i1), _mm_packs_epi32(i2, i3));
+			_mm_storeu_si128((__m128i*) bytes, packed);
+			for (int k = 0; k < 16; k++)
+				d[x + k] = table[bytes[k]];
+		}
+#endif
+		for (; x < src.cols; x++)
+			d[x] = table[saturate_cast<uchar>(s[x] * a)];
+	}
+}
@@ -0,0 +1,27 @@
+#ifndef _QUANTIZATION_H_
+#define _QUANTIZATION_H_
+
+#include <opencv2/core/core.hpp>
+
+// Luminance quantisation by table. The output for a pixel depends only on its 8-bit value, so each
+// mode is a 256 entry lookup table (a 1 x 256 CV_8U Mat, as cv::LUT takes it), built once per
+// parameter change and applied with cv::LUT or fused into the bilateral filter's 8-bit conversion.
+
+// Sharpness of the soft steps in Winnemoeller's units, luminance on a 0..100 scale.
+#define QUANT_SOFT_PHI 3.0
+
+// The hard quantisation the abstraction has always used: values are raised to the top of their
+// bin, bins are floor(255 / levels - 1) wide and the leftover values at the top go to 255.
+void MakeQuantLUT(int levels, cv::Mat& lut);
+
+// Soft quantisation after Winnemoeller et al., "Real-Time Video Abstraction":
+// q_nearest + dq / 2 * tanh(phi * (x - q_nearest)), with dq = 255 / levels and q_nearest the bin
+// boundary nearest to x. Flat regions land on the bin centres and the steps between them are
+// smoothed over a width set by phi, which hides the banding of the hard steps in gradients.
+void MakeSoftQuantLUT(int levels, double phi, cv::Mat& lut);
+
+// dst = lut[saturate(src * alpha)] for a CV_32FC1 src, the same as src.convertTo(tmp, CV_8UC1,
+// alpha) followed by cv::LUT(tmp, lut, dst) but in one pass and without the intermediate plane.
+void ConvertQuantized(const cv::Mat& src, cv::Mat& dst, double alpha, const cv::Mat& lut);
+
+#endif
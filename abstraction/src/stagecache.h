@@ -0,0 +1,39 @@
+#ifndef _STAGECACHE_H_
+#define _STAGECACHE_H_
+
+// Memo of one pipeline stage. The key holds everything the stage's output depends on: its own
+// parameters and the versions of the stages it reads, usually as a std::tuple. needs() tells
+// whether the output is stale for a key; if it is, the key is recorded and the version bumped, so
+// the stages reading this one see the change in their own keys and recompute in turn.
+template<class Key>
+class Stage {
+private:
+	Key key;
+	bool valid;
+	unsigned version;
+public:
+	Stage() :
+			valid(false), version(0) {
+	}
+
+	// True if the output has to be recomputed for k. The caller must then recompute it.
+	bool needs(const Key& k) {
+		if (valid && k == key)
+			return false;
+		key = k;
+		valid = true;
+		version++;
+		return true;
+	}
+
+	// Forces a recompute on the next needs(), e.g. after the output was dropped.
+	void invalidate() {
+		valid = false;
+	}
+
+	unsigned getVersion() const {
+		return version;
+	}
+};
+
+#endif
@@ -0,0 +1,397 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "imatrix.h"
+#include "ETF.h"
+#include "fdog.h"
+#include "myvec.h"
+#include "threadpool.h"
+#include "cldcontext.h"
+#include "cldtile.h"
+#include "fastmath.h"
+#include "synthetic.h"
+
+// Times the stages of the CLD line drawing on synthetic images and writes the results as JSON.
+// Each stage runs once untimed to size its buffers, then "iterations" times; the inputs a stage
+// changes are restored outside the timed region.
+//
+// Besides the stages of the default chain there are the optional ones (flow_sparse, tensor) and
+// the whole frame in each mode the programs offer: cld_bins, cld_sparse, cld_etf2, cld_etf4,
+// cld_tensor, cld_xdog, cld_fast_math and tiled. Every whole-frame result is compared with the
+// line drawing of the exact chain without fast math, and its JSON entry gets the number of pixels
+// that differ and the largest difference in grey levels.
+//
+//   cld-bench [--iterations N] [--size WxH]... [--input gradient|checker|noise|text]...
+//             [--threads N] [--fast-math] [--reference] [--dog-bins N] [--out FILE]
+//
+// --size and --input replace the defaults (640x480, 1280x720, 1920x1080 and all four inputs) and
+// may be repeated. --reference adds the double precision GetDirectionalDoG and GetFlowDoG.
+// --dog-bins sets the angles of the DoGKernelBank the dog_bins stage uses, 32 by default.
+
+#define BENCH_ITERATIONS 20
+#define BENCH_TAU 0.99
+#define BENCH_THRES 0.7
+#define BENCH_DOG_BINS 32
+
+// Every allocation in the process goes through these, so a stage's count is the difference
+// across its call. The counters are atomic because the pool's threads allocate too.
+static std::atomic<long long> allocCount(0);
+static std::atomic<long long> allocBytes(0);
+
+void* operator new(size_t size) {
+	allocCount++;
+	allocBytes += size;
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size) {
+	allocCount++;
+	allocBytes += size;
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept {
+	free(p);
+}
+
+void operator delete[](void* p) noexcept {
+	free(p);
+}
+
+// C++14 compilers call these for objects of known size, they must pair with the malloc above too.
+void operator delete(void* p, size_t) noexcept {
+	operator delete(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+	operator delete[](p);
+}
+
+struct StageResult {
+	std::string input;
+	int width, height;
+	std::string stage;
+	std::vector<double> ms; // one entry per timed iteration
+	long long first_allocs; // allocations of the untimed first call
+	long long allocs, bytes; // allocations of all timed iterations together
+	int diff_pixels, max_diff; // against the exact line drawing, diff_pixels is -1 if not compared
+};
+
+static std::vector<StageResult> results;
+static int iterations = BENCH_ITERATIONS;
+static int dogBins = BENCH_DOG_BINS;
+
+// Runs reset() and then body() once untimed and "iterations" times timed.
+template<class R, class B>
+static void Measure(const char* input, int width, int height, const char* stage, R reset, B body) {
+	StageResult r;
+	r.input = input;
+	r.width = width;
+	r.height = height;
+	r.stage = stage;
+	r.diff_pixels = r.max_diff = -1;
+
+	reset();
+	long long a0 = allocCount;
+	body();
+	r.first_allocs = allocCount - a0;
+
+	r.allocs = r.bytes = 0;
+	for (int k = 0; k < iterations; k++) {
+		reset();
+		long long count = allocCount, bytes = allocBytes;
+		std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+		body();
+		std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+		r.allocs += allocCount - count;
+		r.bytes += allocBytes - bytes;
+		r.ms.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+	}
+	fprintf(stderr, "%-8s %5dx%-5d %-14s %8.2f ms\n", input, width, height, stage,
+			*std::min_element(r.ms.begin(), r.ms.end()));
+	results.push_back(r);
+}
+
+// Nearest-rank percentile of sorted values.
+static double Percentile(const std::vector<double>& sorted, double p) {
+	int rank = (int) (p / 100.0 * sorted.size() + 0.999999);
+	if (rank < 1)
+		rank = 1;
+	if (rank > (int) sorted.size())
+		rank = (int) sorted.size();
+	return sorted[rank - 1];
+}
+
+static void Copy(imatrix& src, imatrix& dst) {
+	for (int i = 0; i < src.getRow(); i++)
+		memcpy(dst[i], src[i], src.getCol() * sizeof(int));
+}
+
+// Records on the last result how far the line drawing out is from the exact one.
+static void CompareLast(imatrix& out, imatrix& exact) {
+	StageResult& r = results.back();
+	r.diff_pixels = r.max_diff = 0;
+	for (int i = 0; i < exact.getRow(); i++) {
+		for (int j = 0; j < exact.getCol(); j++) {
+			int d = abs(out[i][j] - exact[i][j]);
+			if (d > 0)
+				r.diff_pixels++;
+			if (d > r.max_diff)
+				r.max_diff = d;
+		}
+	}
+	fprintf(stderr, "%-35s %8d px differ, by up to %d\n", "", r.diff_pixels, r.max_diff);
+}
+
+static void RunStages(int kind, int width, int height, bool reference) {
+	const char* input = SyntheticName(kind);
+	int rows = height, cols = width;
+
+	imatrix image(rows, cols), work(rows, cols);
+	MakeSynthetic(kind, image);
+
+	ETF_t<float> e0(rows, cols), e(rows, cols), e2(rows, cols);
+	mymatrix gradient(rows, cols);
+	imatrix gmag(rows, cols);
+	mymatrix_t<float> dog(rows, cols), tmp(rows, cols);
+	FDoGWorkspace_t<float> ws;
+	myvec_t<float> GAU1, GAU2, GAU3;
+	MakeGaussianVector(1.0, GAU1);
+	MakeGaussianVector(1.0 * 1.6, GAU2);
+	MakeGaussianVector(3.0, GAU3);
+
+	Measure(input, width, height, "set2", [] {}, [&] {
+		e0.set2(image, gradient, gmag);
+	});
+	Measure(input, width, height, "smooth", [&] {
+		e.copy(e0);
+	}, [&] {
+		e.Smooth(4, 2, e2);
+	});
+	Measure(input, width, height, "dog", [] {}, [&] {
+		GetDirectionalDoGSIMD(image, e, dog, GAU1, GAU2, BENCH_TAU, 0, &ws);
+	});
+	DoGKernelBank bank;
+	MakeDoGKernelBank(1.0, dogBins, bank);
+	mymatrix_t<float> dogBank(rows, cols);
+	Measure(input, width, height, "dog_bins", [] {}, [&] {
+		GetDirectionalDoGQuantized(image, e, dogBank, bank, BENCH_TAU, 0, &ws);
+	});
+	Measure(input, width, height, "flow", [] {}, [&] {
+		GetFlowDoGInterleaved(e, dog, tmp, GAU3, 0, &ws);
+	});
+	mymatrix_t<float> tmpSparse(rows, cols);
+	std::vector<unsigned char> mask;
+	Measure(input, width, height, "flow_sparse", [] {}, [&] {
+		MakeFlowDoGMask(dog, GAU3, mask, 0, &ws);
+		GetFlowDoGInterleaved(e, dog, tmpSparse, GAU3, 0, &ws, &mask[0]);
+	});
+	ETF_t<float> et(rows, cols);
+	std::vector<float> planes;
+	Measure(input, width, height, "tensor", [] {}, [&] {
+		et.setTensor(image, CLD_TENSOR_SIGMA, planes);
+	});
+
+	if (reference) {
+		ETF_t<double> ed(rows, cols), ed2(rows, cols);
+		mymatrix_t<double> dogd(rows, cols), tmpd(rows, cols);
+		myvec_t<double> D1, D2, D3;
+		MakeGaussianVector(1.0, D1);
+		MakeGaussianVector(1.0 * 1.6, D2);
+		MakeGaussianVector(3.0, D3);
+		ed.set2(image, gradient, gmag);
+		ed.Smooth(4, 2, ed2);
+		Measure(input, width, height, "dog_reference", [] {}, [&] {
+			GetDirectionalDoG(image, ed, dogd, D1, D2, BENCH_TAU);
+		});
+		Measure(input, width, height, "flow_reference", [] {}, [&] {
+			GetFlowDoG(ed, dogd, tmpd, D3);
+		});
+	}
+
+	// the lines as GetFDoG leaves them before the threshold
+	imatrix lines(rows, cols);
+	for (int i = 0; i < rows; i++)
+		for (int j = 0; j < cols; j++)
+			lines[i][j] = (int) (tmp[i][j] * 255.0 + 0.5);
+	Measure(input, width, height, "threshold", [&] {
+		Copy(lines, work);
+	}, [&] {
+		GrayThresholding(work, BENCH_THRES);
+	});
+
+	// the whole frame as the programs run it, compared with the exact line drawing
+	bool fastMath = GetFastMath();
+	CldContext context;
+	context.prepare(rows, cols);
+	imatrix exact(rows, cols);
+	SetFastMath(false);
+	Copy(image, context.image);
+	context.run(1.0, 3.0, BENCH_TAU, BENCH_THRES);
+	Copy(context.image, exact);
+	SetFastMath(fastMath);
+
+	CldContext::Options options;
+	auto frame = [&](const char* stage) {
+		context.prepare(rows, cols);
+		Measure(input, width, height, stage, [&] {
+			Copy(image, context.image);
+		}, [&] {
+			context.run(1.0, 3.0, BENCH_TAU, BENCH_THRES, options);
+		});
+		CompareLast(context.image, exact);
+	};
+	frame("cld");
+	if (!fastMath) {
+		SetFastMath(true);
+		frame("cld_fast_math");
+		SetFastMath(false);
+	}
+	options.angle_bins = dogBins;
+	frame("cld_bins");
+	options.angle_bins = 0;
+	options.sparse = true;
+	frame("cld_sparse");
+	options.sparse = false;
+	context.setETFScale(2);
+	frame("cld_etf2");
+	context.setETFScale(4);
+	frame("cld_etf4");
+	context.setETFScale(1);
+	context.setETFMode(CLD_ETF_TENSOR);
+	frame("cld_tensor");
+	context.setETFMode(CLD_ETF_SMOOTH);
+	context.setEdgeMode(CLD_EDGES_XDOG);
+	frame("cld_xdog");
+
+	// the tiler works on 8-bit planes
+	std::vector<unsigned char> src(rows * cols), dst(rows * cols);
+	for (int i = 0; i < rows; i++)
+		for (int j = 0; j < cols; j++)
+			src[i * cols + j] = (unsigned char) image[i][j];
+	CldTiler tiler;
+	Measure(input, width, height, "tiled", [] {}, [&] {
+		tiler.run(&src[0], cols, &dst[0], cols, rows, cols, 1.0, 3.0, BENCH_TAU, BENCH_THRES);
+	});
+	for (int i = 0; i < rows; i++)
+		for (int j = 0; j < cols; j++)
+			work[i][j] = dst[i * cols + j];
+	CompareLast(work, exact);
+}
+
+static void WriteJSON(FILE* out, bool fastMath) {
+	fprintf(out, "{\n");
+	fprintf(out, "  \"threads\": %d,\n", ThreadPool::shared().getThreads());
+	fprintf(out, "  \"fast_math\": %s,\n", fastMath ? "true" : "false");
+	fprintf(out, "  \"iterations\": %d,\n", iterations);
+	fprintf(out, "  \"results\": [\n");
+	for (size_t k = 0; k < results.size(); k++) {
+		StageResult& r = results[k];
+		std::vector<double> sorted(r.ms);
+		std::sort(sorted.begin(), sorted.end());
+		double mean = 0.0;
+		for (size_t n = 0; n < sorted.size(); n++)
+			mean += sorted[n];
+		mean /= sorted.size();
+		double p50 = Percentile(sorted, 50);
+		double mpix = (double) r.width * r.height / 1e6;
+
+		fprintf(out, "    { \"input\": \"%s\", \"width\": %d, \"height\": %d, \"stage\": \"%s\",\n",
+				r.input.c_str(), r.width, r.height, r.stage.c_str());
+		fprintf(out, "      \"min_ms\": %.3f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, "
+				"\"max_ms\": %.3f, \"mean_ms\": %.3f,\n", sorted.front(), p50, Percentile(sorted, 90),
+				Percentile(sorted, 99), sorted.back(), mean);
+		fprintf(out, "      \"mpix_per_s\": %.2f, \"first_allocs\": %lld, \"allocs_per_iter\": %.2f, "
+				"\"alloc_bytes_per_iter\": %.0f", mpix / (p50 / 1000.0), r.first_allocs,
+				(double) r.allocs / iterations, (double) r.bytes / iterations);
+		if (r.diff_pixels >= 0)
+			fprintf(out, ", \"diff_pixels\": %d, \"max_diff\": %d", r.diff_pixels, r.max_diff);
+		fprintf(out, " }%s\n", (k + 1 < results.size()) ? "," : "");
+	}
+	fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char** argv) {
+	std::vector<int> widths, heights, kinds;
+	bool fastMath = false, reference = false;
+	const char* outPath = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+			iterations = atoi(argv[++i]);
+			if (iterations < 1)
+				iterations = 1;
+		} else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+			int w, h;
+			if (sscanf(argv[++i], "%dx%d", &w, &h) != 2 || w < 3 || h < 3) {
+				fprintf(stderr, "bad size %s, expected WxH\n", argv[i]);
+				return 1;
+			}
+			widths.push_back(w);
+			heights.push_back(h);
+		} else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+			int kind = SyntheticKind(argv[++i]);
+			if (kind < 0) {
+				fprintf(stderr, "unknown input %s\n", argv[i]);
+				return 1;
+			}
+			kinds.push_back(kind);
+		} else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			ThreadPool::setSharedThreads(atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--fast-math") == 0) {
+			fastMath = true;
+		} else if (strcmp(argv[i], "--reference") == 0) {
+			reference = true;
+		} else if (strcmp(argv[i], "--dog-bins") == 0 && i + 1 < argc) {
+			dogBins = atoi(argv[++i]);
+			if (dogBins < 1) {
+				fprintf(stderr, "bad bin count %s\n", argv[i]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+			outPath = argv[++i];
+		} else {
+			fprintf(stderr, "unknown argument %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	if (widths.empty()) {
+		int defaults[3][2] = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 } };
+		for (int k = 0; k < 3; k++) {
+			widths.push_back(defaults[k][0]);
+			heights.push_back(defaults[k][1]);
+		}
+	}
+	if (kinds.empty())
+		for (int k = 0; k < SYNTH_COUNT; k++)
+			kinds.push_back(k);
+	SetFastMath(fastMath);
+
+	for (size_t s = 0; s < widths.size(); s++)
+		for (size_t k = 0; k < kinds.size(); k++)
+			RunStages(kinds[k], widths[s], heights[s], reference);
+
+	FILE* out = outPath ? fopen(outPath, "w") : stdout;
+	if (!out) {
+		fprintf(stderr, "cannot write %s\n", outPath);
+		return 1;
+	}
+	WriteJSON(out, fastMath);
+	if (outPath)
+		fclose(out);
+	return 0;
+}
@@ -0,0 +1,98 @@
+#include <string.h>
+
+#include "synthetic.h"
+
+static const char* names[SYNTH_COUNT] = { "gradient", "checker", "noise", "text" };
+
+// 5 x 7 capitals for the text image, one byte per row with the leftmost pixel in bit 4.
+struct Glyph {
+	char c;
+	unsigned char rows[7];
+};
+
+static const Glyph font[] = {
+	{ 'A', { 0x0E, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11 } },
+	{ 'B', { 0x1E, 0x11, 0x11, 0x1E, 0x11, 0x11, 0x1E } },
+	{ 'C', { 0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E } },
+	{ 'D', { 0x1E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x1E } },
+	{ 'E', { 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x1F } },
+	{ 'G', { 0x0E, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0F } },
+	{ 'H', { 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11 } },
+	{ 'I', { 0x0E, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E } },
+	{ 'L', { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1F } },
+	{ 'N', { 0x11, 0x19, 0x15, 0x13, 0x11, 0x11, 0x11 } },
+	{ 'R', { 0x1E, 0x11, 0x11, 0x1E, 0x14, 0x12, 0x11 } },
+	{ 'W', { 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0A } },
+};
+
+#define TEXT_SCALE 3 // pixels per font pixel
+#define TEXT_CELL_X (6 * TEXT_SCALE)
+#define TEXT_CELL_Y (10 * TEXT_SCALE)
+#define TEXT_INK 30
+#define TEXT_PAPER 225
+
+static const Glyph* FindGlyph(char c) {
+	for (size_t k = 0; k < sizeof(font) / sizeof(font[0]); k++)
+		if (font[k].c == c)
+			return &font[k];
+	return 0;
+}
+
+const char* SyntheticName(int kind) {
+	return (kind >= 0 && kind < SYNTH_COUNT) ? names[kind] : "";
+}
+
+int SyntheticKind(const char* name) {
+	for (int k = 0; k < SYNTH_COUNT; k++)
+		if (strcmp(name, names[k]) == 0)
+			return k;
+	return -1;
+}
+
+void MakeSynthetic(int kind, imatrix& image) {
+	int rows = image.getRow();
+	int cols = image.getCol();
+	int i, j;
+
+	switch (kind) {
+	case SYNTH_GRADIENT:
+		for (i = 0; i < rows; i++)
+			for (j = 0; j < cols; j++)
+				image[i][j] = (int) (255.0 * (i + j) / (rows + cols - 2 > 0 ? rows + cols - 2 : 1));
+		break;
+	case SYNTH_CHECKER:
+		for (i = 0; i < rows; i++)
+			for (j = 0; j < cols; j++)
+				image[i][j] = ((i / 32 + j / 32) % 2) ? 215 : 40;
+		break;
+	case SYNTH_NOISE: {
+		unsigned int seed = 12345;
+		for (i = 0; i < rows; i++)
+			for (j = 0; j < cols; j++) {
+				seed = seed * 1103515245 + 12345;
+				image[i][j] = (seed >> 16) & 0xFF;
+			}
+		break;
+	}
+	case SYNTH_TEXT: {
+		static const char* line = "CLD LINE DRAWING BENCH ";
+		int length = (int) strlen(line);
+		for (i = 0; i < rows; i++)
+			for (j = 0; j < cols; j++)
+				image[i][j] = TEXT_PAPER;
+		// each text row starts one character further on, so the columns do not line up
+		for (int y = 0, n = 0; y + 7 * TEXT_SCALE <= rows; y += TEXT_CELL_Y, n++) {
+			for (int x = 0, k = n; x + 5 * TEXT_SCALE <= cols; x += TEXT_CELL_X, k++) {
+				const Glyph* g = FindGlyph(line[k % length]);
+				if (!g)
+					continue;
+				for (i = 0; i < 7 * TEXT_SCALE; i++)
+					for (j = 0; j < 5 * TEXT_SCALE; j++)
+						if (g->rows[i / TEXT_SCALE] & (0x10 >> (j / TEXT_SCALE)))
+							image[y + i][x + j] = TEXT_INK;
+			}
+		}
+		break;
+	}
+	}
+}
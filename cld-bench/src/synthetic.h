@@ -0,0 +1,20 @@
+#ifndef _SYNTHETIC_H_
+#define _SYNTHETIC_H_
+
+#include "imatrix.h"
+
+// Deterministic 8-bit test images for the benchmark, the same for a given name and size on every
+// run and platform.
+#define SYNTH_GRADIENT 0 // diagonal ramp, no edges at all
+#define SYNTH_CHECKER 1 // 32 pixel squares, long straight edges
+#define SYNTH_NOISE 2 // uniform noise, edges everywhere
+#define SYNTH_TEXT 3 // lines of block capitals, short curved strokes
+#define SYNTH_COUNT 4
+
+const char* SyntheticName(int kind);
+// Returns the SYNTH_* constant for a name, or -1.
+int SyntheticKind(const char* name);
+// Fills image, which must already have its size.
+void MakeSynthetic(int kind, imatrix& image);
+
+#endif
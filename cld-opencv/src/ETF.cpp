@@ -1,23 +1,30 @@
 #include <cmath>
 
 #include "ETF.h"
+#include "fastmath.h"
+#include "fdog.h"
 #include "imatrix.h"
 #include "myvec.h"
+#include "threadpool.h"
 
-void ETF::set(imatrix& image) {
+// Smoothing window of the production Smooth(4, 2), which SmoothPass has a compiled-in variant for.
+#define ETF_PRESET_HALF_W 4
+
+template<class T>
+void ETF_t<T>::set(imatrix& image) {
 	int i, j;
-	double MAX_VAL = 1020.;
-	double v[2];
+	T MAX_VAL = 1020.;
+	T v[2];
 
 	max_grad = -1.;
 
 	for (i = 1; i < Nr - 1; i++) {
 		for (j = 1; j < Nc - 1; j++) {
 			////////////////////////////////////////////////////////////////
-			p[i][j].tx = (image[i + 1][j - 1] + 2 * (double) image[i + 1][j] + image[i + 1][j + 1] - image[i - 1][j - 1]
-					- 2 * (double) image[i - 1][j] - image[i - 1][j + 1]) / MAX_VAL;
-			p[i][j].ty = (image[i - 1][j + 1] + 2 * (double) image[i][j + 1] + image[i + 1][j + 1] - image[i - 1][j - 1]
-					- 2 * (double) image[i][j - 1] - image[i + 1][j - 1]) / MAX_VAL;
+			p[i][j].tx = (image[i + 1][j - 1] + 2 * (T) image[i + 1][j] + image[i + 1][j + 1] - image[i - 1][j - 1]
+					- 2 * (T) image[i - 1][j] - image[i - 1][j + 1]) / MAX_VAL;
+			p[i][j].ty = (image[i - 1][j + 1] + 2 * (T) image[i][j + 1] + image[i + 1][j + 1] - image[i - 1][j - 1]
+					- 2 * (T) image[i][j - 1] - image[i + 1][j - 1]) / MAX_VAL;
 			/////////////////////////////////////////////
 			v[0] = p[i][j].tx;
 			v[1] = p[i][j].ty;
@@ -67,30 +74,43 @@ void ETF::set(imatrix& image) {
 
 }
 
-void ETF::set2(imatrix& image) {
+template<class T>
+void ETF_t<T>::set2(imatrix& image) {
+	mymatrix tmp(Nr, Nc);
+	imatrix gmag(Nr, Nc);
+	set2(image, tmp, gmag);
+}
+
+// Same as set2(image), with the gradient magnitude planes supplied by the caller so that they can be
+// kept between frames. They are resized if they do not match the field. The magnitude is quantised to
+// 8 bits in gmag, so it is always computed in double: a float magnitude would round some pixels to a
+// different level than the reference and the difference grows through Smooth and the flow DoG.
+template<class T>
+void ETF_t<T>::set2(imatrix& image, mymatrix& tmp, imatrix& gmag) {
 	int i, j;
-	double MAX_VAL = 1020.;
-	double v[2];
+	T MAX_VAL = 1020.;
+	T v[2];
+	double gx, gy, max_mag;
 
-	max_grad = -1.;
+	max_mag = -1.;
 
-	mymatrix tmp(Nr, Nc);
+	if (tmp.getRow() != Nr || tmp.getCol() != Nc)
+		tmp.init(Nr, Nc);
+	if (gmag.getRow() != Nr || gmag.getCol() != Nc)
+		gmag.init(Nr, Nc);
 
 	for (i = 1; i < Nr - 1; i++) {
 		for (j = 1; j < Nc - 1; j++) {
 			////////////////////////////////////////////////////////////////
-			p[i][j].tx = (image[i + 1][j - 1] + 2 * (double) image[i + 1][j] + image[i + 1][j + 1] - image[i - 1][j - 1]
-					- 2 * (double) image[i - 1][j] - image[i - 1][j + 1]) / MAX_VAL;
-			p[i][j].ty = (image[i - 1][j + 1] + 2 * (double) image[i][j + 1] + image[i + 1][j + 1] - image[i - 1][j - 1]
-					- 2 * (double) image[i][j - 1] - image[i + 1][j - 1]) / MAX_VAL;
-			/////////////////////////////////////////////
-			v[0] = p[i][j].tx;
-			v[1] = p[i][j].ty;
+			gx = (image[i + 1][j - 1] + 2 * (double) image[i + 1][j] + image[i + 1][j + 1] - image[i - 1][j - 1]
+					- 2 * (double) image[i - 1][j] - image[i - 1][j + 1]) / 1020.;
+			gy = (image[i - 1][j + 1] + 2 * (double) image[i][j + 1] + image[i + 1][j + 1] - image[i - 1][j - 1]
+					- 2 * (double) image[i][j - 1] - image[i + 1][j - 1]) / 1020.;
 			//////////////////////////////////////////////
-			tmp[i][j] = sqrt(p[i][j].tx * p[i][j].tx + p[i][j].ty * p[i][j].ty);
+			tmp[i][j] = sqrt(gx * gx + gy * gy);
 
-			if (tmp[i][j] > max_grad) {
-				max_grad = tmp[i][j];
+			if (tmp[i][j] > max_mag) {
+				max_mag = tmp[i][j];
 			}
 		}
 	}
@@ -110,12 +130,14 @@ void ETF::set2(imatrix& image) {
 	tmp[Nr - 1][0] = (tmp[Nr - 1][1] + tmp[Nr - 2][0]) / 2;
 	tmp[Nr - 1][Nc - 1] = (tmp[Nr - 1][Nc - 2] + tmp[Nr - 2][Nc - 1]) / 2;
 
-	imatrix gmag(Nr, Nc);
+	max_grad = (T) max_mag;
 
-	// normalize the magnitude
+	// normalize the magnitude, a flat image has none to normalize
+	if (max_mag <= 0.0)
+		max_mag = 1.0;
 	for (i = 0; i < Nr; i++) {
 		for (j = 0; j < Nc; j++) {
-			tmp[i][j] /= max_grad;
+			tmp[i][j] /= max_mag;
 			gmag[i][j] = round(tmp[i][j] * 255.0);
 		}
 	}
@@ -123,10 +145,10 @@ void ETF::set2(imatrix& image) {
 	for (i = 1; i < Nr - 1; i++) {
 		for (j = 1; j < Nc - 1; j++) {
 			////////////////////////////////////////////////////////////////
-			p[i][j].tx = (gmag[i + 1][j - 1] + 2 * (double) gmag[i + 1][j] + gmag[i + 1][j + 1] - gmag[i - 1][j - 1]
-					- 2 * (double) gmag[i - 1][j] - gmag[i - 1][j + 1]) / MAX_VAL;
-			p[i][j].ty = (gmag[i - 1][j + 1] + 2 * (double) gmag[i][j + 1] + gmag[i + 1][j + 1] - gmag[i - 1][j - 1]
-					- 2 * (double) gmag[i][j - 1] - gmag[i + 1][j - 1]) / MAX_VAL;
+			p[i][j].tx = (gmag[i + 1][j - 1] + 2 * (T) gmag[i + 1][j] + gmag[i + 1][j + 1] - gmag[i - 1][j - 1]
+					- 2 * (T) gmag[i - 1][j] - gmag[i - 1][j + 1]) / MAX_VAL;
+			p[i][j].ty = (gmag[i - 1][j + 1] + 2 * (T) gmag[i][j + 1] + gmag[i + 1][j + 1] - gmag[i - 1][j - 1]
+					- 2 * (T) gmag[i][j - 1] - gmag[i + 1][j - 1]) / MAX_VAL;
 			/////////////////////////////////////////////
 			v[0] = p[i][j].tx;
 			v[1] = p[i][j].ty;
@@ -175,17 +197,126 @@ void ETF::set2(imatrix& image) {
 	normalize();
 }
 
-inline void make_unit(double& vx, double& vy) {
-	double mag = sqrt(vx * vx + vy * vy);
-	if (mag != 0.0) {
-		vx /= mag;
-		vy /= mag;
+// Sobel gradient products gx * gx, gx * gy and gy * gy of row i into e, f and g, with gx along the
+// first index like set2. Neighbours are clamped to the image. The rows are padded by half samples
+// at both ends with the end columns repeated, as GaussPaddedRow reads them.
+template<class T>
+static void TensorRow(imatrix& image, int image_x, int image_y, int i, int half, T* e, T* f, T* g) {
+	const int* up = image[(i > 0) ? i - 1 : 0];
+	const int* mid = image[i];
+	const int* down = image[(i < image_x - 1) ? i + 1 : image_x - 1];
+	T gx, gy;
+	int j, l, r;
+
+	e += half;
+	f += half;
+	g += half;
+	for (j = 0; j < image_y; j++) {
+		l = (j > 0) ? j - 1 : 0;
+		r = (j < image_y - 1) ? j + 1 : image_y - 1;
+		gx = (down[l] + 2 * (T) down[j] + down[r] - up[l] - 2 * (T) up[j] - up[r]) / (T) 1020.;
+		gy = (up[r] + 2 * (T) mid[r] + down[r] - up[l] - 2 * (T) mid[l] - down[l]) / (T) 1020.;
+		e[j] = gx * gx;
+		f[j] = gx * gy;
+		g[j] = gy * gy;
+	}
+	for (j = 1; j <= half; j++) {
+		e[-j] = e[0];
+		f[-j] = f[0];
+		g[-j] = g[0];
+		e[image_y - 1 + j] = e[image_y - 1];
+		f[image_y - 1 + j] = f[image_y - 1];
+		g[image_y - 1 + j] = g[image_y - 1];
 	}
 }
 
-void ETF::normalize() {
+template<class T>
+void ETF_t<T>::setTensor(imatrix& image, double sigma, std::vector<T>& planes, ThreadPool* threads) {
+	int image_x = Nr;
+	int image_y = Nc;
+	ThreadPool& pool = threads ? *threads : ThreadPool::shared();
+
+	// GaussSmoothSep's taps at the front of planes, then three padded tensor planes and their
+	// horizontal blurs
+	int half = MakeGaussTaps(sigma, planes);
+	int taps = 2 * half + 1;
+	int stride = image_y + 2 * half;
+	size_t padded = (size_t) image_x * stride;
+	size_t size = (size_t) image_x * image_y;
+	planes.resize(taps + 3 * padded + 3 * size);
+	const T* w = &planes[0];
+	T* tensor[3] = { &planes[taps], &planes[taps + padded], &planes[taps + 2 * padded] };
+	T* blur[3] = { &planes[taps + 3 * padded], &planes[taps + 3 * padded + size], &planes[taps + 3 * padded + 2 * size] };
+
+	pool.parallelFor(image_x, CLD_BAND_ROWS, [&](int row_begin, int row_end) {
+		for (int i = row_begin; i < row_end; i++) {
+			size_t row = (size_t) i * stride;
+			TensorRow(image, image_x, image_y, i, half, tensor[0] + row, tensor[1] + row, tensor[2] + row);
+			for (int k = 0; k < 3; k++)
+				GaussPaddedRow(tensor[k] + row, blur[k] + (size_t) i * image_y, image_y, w, half);
+		}
+	});
+
+	// Vertical blur into the tensor rows, which are no longer needed, then the eigenvectors. With
+	// the tensor [E F; F G], d = E - G and r = sqrt(d^2 + 4 F^2), the gradient makes the angle
+	// theta with cos(2 theta) = d / r and the sign of F, and the major eigenvalue is (E + G + r) / 2.
+	pool.parallelFor(image_x, CLD_BAND_ROWS, [&](int row_begin, int row_end) {
+		int i, j, k, s, r;
+		for (i = row_begin; i < row_end; i++) {
+			T* acc[3];
+			for (k = 0; k < 3; k++) {
+				acc[k] = tensor[k] + (size_t) i * stride;
+				for (j = 0; j < image_y; j++)
+					acc[k][j] = 0.0;
+				for (s = -half; s <= half; s++) {
+					r = i + s;
+					r = (r < 0) ? 0 : (r > image_x - 1) ? image_x - 1 : r;
+					GaussAccumulateRow(blur[k] + (size_t) r * image_y, w[s + half], acc[k], image_y);
+				}
+			}
+			for (j = 0; j < image_y; j++) {
+				Vect_t<T>& v = p[i][j];
+				T E = acc[0][j], F = acc[1][j], G = acc[2][j];
+				T d = E - G;
+				T root = sqrt(d * d + 4 * F * F);
+				T lambda = (E + G + root) / 2;
+				if (root <= 0 || lambda <= 0) {
+					// flat or isotropic, no direction
+					v.tx = v.ty = v.mag = 0.0;
+					continue;
+				}
+				T cos2 = d / root;
+				T gx = sqrt((1 + cos2) / 2);
+				T gy = sqrt((1 - cos2) / 2);
+				if (F < 0)
+					gy = -gy;
+				v.tx = -gy;
+				v.ty = gx;
+				v.mag = sqrt(lambda);
+			}
+		}
+	});
+
+	max_grad = 0.0;
+	for (int i = 0; i < image_x; i++)
+		for (int j = 0; j < image_y; j++)
+			if (p[i][j].mag > max_grad)
+				max_grad = p[i][j].mag;
+	if (max_grad <= 0)
+		return;
+	pool.parallelFor(image_x, CLD_BAND_ROWS, [&](int row_begin, int row_end) {
+		for (int i = row_begin; i < row_end; i++)
+			for (int j = 0; j < image_y; j++)
+				p[i][j].mag /= max_grad;
+	});
+}
+
+template<class T>
+void ETF_t<T>::normalize() {
 	int i, j;
 
+	if (max_grad <= 0.0)
+		max_grad = 1.0;
 	for (i = 0; i < Nr; i++) {
 		for (j = 0; j < Nc; j++) {
 			make_unit(p[i][j].tx, p[i][j].ty);
@@ -194,110 +325,265 @@ void ETF::normalize() {
 	}
 }
 
-void ETF::Smooth(int half_w, int M) {
-	int i, j, k;
-	int MAX_GRADIENT = -1;
-	double weight;
-	int s, t;
-	int x, y;
-	double mag_diff;
+template<class T>
+void ETF_t<T>::Smooth(int half_w, int M) {
+	ETF_t e2;
+	Smooth(half_w, M, e2);
+}
 
+// Same as Smooth(half_w, M), with the intermediate field supplied by the caller.
+template<class T>
+void ETF_t<T>::Smooth(int half_w, int M, ETF_t& e2) {
 	int image_x = getRow();
 	int image_y = getCol();
 
-	ETF e2;
-
-	e2.init(image_x, image_y);
+	if (e2.getRow() != image_x || e2.getCol() != image_y)
+		e2.init(image_x, image_y);
 	e2.copy(*this);
 
-	double v[2], w[2], g[2];
-	double angle;
-	double factor;
-
-	for (k = 0; k < M; k++) {
+	for (int k = 0; k < M; k++) {
 		////////////////////////
 		// horizontal
-		for (j = 0; j < image_y; j++) {
-			for (i = 0; i < image_x; i++) {
-				g[0] = g[1] = 0.0;
-				v[0] = p[i][j].tx;
-				v[1] = p[i][j].ty;
+		SmoothPass(p, e2.p, image_x, image_y, half_w, 0, 0, image_x, 0, image_y);
+		this->copy(e2);
+		/////////////////////////////////
+		// vertical
+		SmoothPass(p, e2.p, image_x, image_y, half_w, 1, 0, image_x, 0, image_y);
+		this->copy(e2);
+	}
+	////////////////////////////////////////////
+}
+
+// SmoothPass with the window compiled in for HALF_W > 0 and taken from half_w for HALF_W = 0.
+// Pixels whose whole window lies in the field skip the clamping.
+template<class T, int HALF_W>
+static void SmoothPassT(Vect_t<T>* const * src, Vect_t<T>* const * dst, int image_x, int image_y, int half_w,
+		int axis, int row_begin, int row_end, int col_begin, int col_end) {
+	int i, j;
+	T weight;
+	int s;
+	int x, y;
+	T mag_diff;
+
+	T v[2], w[2], g[2];
+	T angle;
+	T factor;
+	bool fast = GetFastMath();
+
+	if (HALF_W > 0)
+		half_w = HALF_W;
+
+	for (i = row_begin; i < row_end; i++) {
+		bool rows_inside = (i - half_w >= 0 && i + half_w <= image_x - 1);
+		for (j = col_begin; j < col_end; j++) {
+			const Vect_t<T>& c = src[i][j];
+			g[0] = g[1] = 0.0;
+			v[0] = c.tx;
+			v[1] = c.ty;
+			if ((axis == 0) ? rows_inside : (j - half_w >= 0 && j + half_w <= image_y - 1)) {
+				// no clamping, the taps are unrolled when half_w is compiled in
 				for (s = -half_w; s <= half_w; s++) {
-					////////////////////////////////////////
-					x = i + s;
-					y = j;
-					if (x > image_x - 1)
-						x = image_x - 1;
-					else if (x < 0)
-						x = 0;
-					if (y > image_y - 1)
-						y = image_y - 1;
-					else if (y < 0)
-						y = 0;
-					////////////////////////////////////////
-					mag_diff = p[x][y].mag - p[i][j].mag;
-					//////////////////////////////////////////////////////
-					w[0] = p[x][y].tx;
-					w[1] = p[x][y].ty;
-					////////////////////////////////
-					factor = 1.0;
-					angle = v[0] * w[0] + v[1] * w[1];
-					if (angle < 0.0) {
-						factor = -1.0;
-					}
+					const Vect_t<T>& n = (axis == 0) ? src[i + s][j] : src[i][j + s];
+					mag_diff = n.mag - c.mag;
+					factor = (v[0] * n.tx + v[1] * n.ty < 0.0) ? -1.0 : 1.0;
 					weight = mag_diff + 1;
-					//////////////////////////////////////////////////////
-					g[0] += weight * p[x][y].tx * factor;
-					g[1] += weight * p[x][y].ty * factor;
+					g[0] += weight * n.tx * factor;
+					g[1] += weight * n.ty * factor;
+				}
+				if (fast)
+					make_unit_fast(g[0], g[1]);
+				else
+					make_unit(g[0], g[1]);
+				dst[i][j].tx = g[0];
+				dst[i][j].ty = g[1];
+				continue;
+			}
+			for (s = -half_w; s <= half_w; s++) {
+				////////////////////////////////////////
+				x = (axis == 0) ? i + s : i;
+				y = (axis == 0) ? j : j + s;
+				if (x > image_x - 1)
+					x = image_x - 1;
+				else if (x < 0)
+					x = 0;
+				if (y > image_y - 1)
+					y = image_y - 1;
+				else if (y < 0)
+					y = 0;
+				////////////////////////////////////////
+				mag_diff = src[x][y].mag - src[i][j].mag;
+				//////////////////////////////////////////////////////
+				w[0] = src[x][y].tx;
+				w[1] = src[x][y].ty;
+				////////////////////////////////
+				factor = 1.0;
+				angle = v[0] * w[0] + v[1] * w[1];
+				if (angle < 0.0) {
+					factor = -1.0;
 				}
+				weight = mag_diff + 1;
+				//////////////////////////////////////////////////////
+				g[0] += weight * src[x][y].tx * factor;
+				g[1] += weight * src[x][y].ty * factor;
+			}
+			if (fast)
+				make_unit_fast(g[0], g[1]);
+			else
 				make_unit(g[0], g[1]);
-				e2[i][j].tx = g[0];
-				e2[i][j].ty = g[1];
+			dst[i][j].tx = g[0];
+			dst[i][j].ty = g[1];
+		}
+	}
+}
+
+// Runs the compiled-in variant for the production window, the generic one otherwise.
+template<class T>
+void SmoothPass(Vect_t<T>* const * src, Vect_t<T>* const * dst, int image_x, int image_y, int half_w, int axis,
+		int row_begin, int row_end, int col_begin, int col_end) {
+	if (half_w == ETF_PRESET_HALF_W)
+		SmoothPassT<T, ETF_PRESET_HALF_W>(src, dst, image_x, image_y, half_w, axis, row_begin, row_end, col_begin,
+				col_end);
+	else
+		SmoothPassT<T, 0>(src, dst, image_x, image_y, half_w, axis, row_begin, row_end, col_begin, col_end);
+}
+
+// Fills this field from a field computed on a smaller copy of the image. Tangents are orientations,
+// t and -t are the same edge, so they are interpolated bilinearly as doubled angles
+// (tx^2 - ty^2, 2 tx ty), where opposite signs add up instead of cancelling, and the result is halved
+// back. The half-angle vector takes the sign of the nearest coarse tangent, which keeps the sign
+// pattern of the coarse field for the flow DoG. Magnitudes are interpolated directly.
+template<class T>
+void ETF_t<T>::Upsample(ETF_t& coarse) {
+	int i, j;
+	int x0, x1, y0, y1;
+	T x, y, fx, fy, w, c, s, r, tx, ty;
+	Vect_t<T>* q[4];
+	T wq[4];
+
+	int cr = coarse.getRow();
+	int cc = coarse.getCol();
+	T sx = (T) cr / Nr;
+	T sy = (T) cc / Nc;
+
+	for (i = 0; i < Nr; i++) {
+		x = (i + (T) 0.5) * sx - (T) 0.5;
+		if (x < 0)
+			x = 0;
+		if (x > cr - 1)
+			x = (T) (cr - 1);
+		x0 = (int) x;
+		x1 = (x0 + 1 < cr) ? x0 + 1 : x0;
+		fx = x - x0;
+		for (j = 0; j < Nc; j++) {
+			y = (j + (T) 0.5) * sy - (T) 0.5;
+			if (y < 0)
+				y = 0;
+			if (y > cc - 1)
+				y = (T) (cc - 1);
+			y0 = (int) y;
+			y1 = (y0 + 1 < cc) ? y0 + 1 : y0;
+			fy = y - y0;
+
+			q[0] = &coarse.p[x0][y0];
+			q[1] = &coarse.p[x0][y1];
+			q[2] = &coarse.p[x1][y0];
+			q[3] = &coarse.p[x1][y1];
+			wq[0] = (1 - fx) * (1 - fy);
+			wq[1] = (1 - fx) * fy;
+			wq[2] = fx * (1 - fy);
+			wq[3] = fx * fy;
+
+			c = s = 0;
+			p[i][j].mag = 0;
+			for (int k = 0; k < 4; k++) {
+				w = wq[k];
+				c += w * (q[k]->tx * q[k]->tx - q[k]->ty * q[k]->ty);
+				s += w * 2 * q[k]->tx * q[k]->ty;
+				p[i][j].mag += w * q[k]->mag;
+			}
+
+			r = sqrt(c * c + s * s);
+			if (r == 0.0) {
+				p[i][j].tx = p[i][j].ty = 0;
+				continue;
+			}
+			c /= r;
+			tx = sqrt((1 + c) / 2);
+			ty = sqrt((1 - c) / 2);
+			if (s < 0)
+				ty = -ty;
+
+			Vect_t<T>& n = coarse.p[(int) (x + (T) 0.5)][(int) (y + (T) 0.5)];
+			if (tx * n.tx + ty * n.ty < 0) {
+				tx = -tx;
+				ty = -ty;
 			}
+			p[i][j].tx = tx;
+			p[i][j].ty = ty;
 		}
-		this->copy(e2);
-		/////////////////////////////////
-		// vertical
-		for (j = 0; j < image_y; j++) {
-			for (i = 0; i < image_x; i++) {
-				g[0] = g[1] = 0.0;
-				v[0] = p[i][j].tx;
-				v[1] = p[i][j].ty;
-				for (t = -half_w; t <= half_w; t++) {
-					////////////////////////////////////////
-					x = i;
-					y = j + t;
-					if (x > image_x - 1)
-						x = image_x - 1;
-					else if (x < 0)
-						x = 0;
-					if (y > image_y - 1)
-						y = image_y - 1;
-					else if (y < 0)
-						y = 0;
-					////////////////////////////////////////
-					mag_diff = p[x][y].mag - p[i][j].mag;
-					//////////////////////////////////////////////////////
-					w[0] = p[x][y].tx;
-					w[1] = p[x][y].ty;
-					////////////////////////////////
-					factor = 1.0;
-					///////////////////////////////
-					angle = v[0] * w[0] + v[1] * w[1];
-					if (angle < 0.0)
-						factor = -1.0;
-					/////////////////////////////////////////////////////////
-					weight = mag_diff + 1;
-					//////////////////////////////////////////////////////
-					g[0] += weight * p[x][y].tx * factor;
-					g[1] += weight * p[x][y].ty * factor;
+	}
+	max_grad = coarse.max_grad;
+}
+
+// Seeds this freshly set field with prev, the smoothed field of the previous video frame. Where the
+// gradient magnitude map gmag is unchanged from prev_gmag the previous tangent is kept, and it gives
+// way linearly to the new tangent as the magnitude changes by up to "change" levels. Tangents are
+// aligned before blending as t and -t are the same edge. Magnitudes stay those of the current frame.
+template<class T>
+void ETF_t<T>::Blend(ETF_t& prev, imatrix& gmag, imatrix& prev_gmag, int change) {
+	int i, j, d;
+	T a, tx, ty;
+
+	for (i = 0; i < Nr; i++) {
+		for (j = 0; j < Nc; j++) {
+			d = gmag[i][j] - prev_gmag[i][j];
+			if (d < 0)
+				d = -d;
+			if (d >= change)
+				continue;
+			a = (T) d / change;
+
+			tx = prev.p[i][j].tx;
+			ty = prev.p[i][j].ty;
+			if (tx * p[i][j].tx + ty * p[i][j].ty < 0) {
+				tx = -tx;
+				ty = -ty;
+			}
+			tx = a * p[i][j].tx + (1 - a) * tx;
+			ty = a * p[i][j].ty + (1 - a) * ty;
+			make_unit(tx, ty);
+			p[i][j].tx = tx;
+			p[i][j].ty = ty;
+		}
+	}
+}
+
+void DownsampleImage(imatrix& image, int factor, imatrix& small) {
+	int i, j, x, y, sum, count;
+
+	int image_x = image.getRow();
+	int image_y = image.getCol();
+	int small_x = (image_x + factor - 1) / factor;
+	int small_y = (image_y + factor - 1) / factor;
+
+	if (small.getRow() != small_x || small.getCol() != small_y)
+		small.init(small_x, small_y);
+
+	for (i = 0; i < small_x; i++) {
+		for (j = 0; j < small_y; j++) {
+			sum = count = 0;
+			for (x = i * factor; x < (i + 1) * factor && x < image_x; x++) {
+				for (y = j * factor; y < (j + 1) * factor && y < image_y; y++) {
+					sum += image[x][y];
+					count++;
 				}
-				make_unit(g[0], g[1]);
-				e2[i][j].tx = g[0];
-				e2[i][j].ty = g[1];
 			}
+			small[i][j] = (sum + count / 2) / count;
 		}
-		this->copy(e2);
 	}
-	////////////////////////////////////////////
 }
+
+template class ETF_t<float>;
+template class ETF_t<double>;
+template void SmoothPass(Vect_t<float>* const *, Vect_t<float>* const *, int, int, int, int, int, int, int, int);
+template void SmoothPass(Vect_t<double>* const *, Vect_t<double>* const *, int, int, int, int, int, int, int, int);
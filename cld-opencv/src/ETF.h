@@ -1,34 +1,52 @@
 #ifndef _ETF_H_
 #define _ETF_H_
 
+#include <vector>
+
 #include "imatrix.h"
+#include "myvec.h"
+#include "threadpool.h"
 
-struct Vect {
-	double tx, ty, mag;
+template<class T>
+struct Vect_t {
+	T tx, ty, mag;
 };
 
-class ETF {
+typedef Vect_t<double> Vect;
+
+template<class T>
+inline void make_unit(T& vx, T& vy) {
+	T mag = sqrt(vx * vx + vy * vy);
+	if (mag != 0.0) {
+		vx /= mag;
+		vy /= mag;
+	}
+}
+
+// Edge tangent flow, templated on its scalar like myvec_t and mymatrix_t.
+template<class T>
+class ETF_t {
 private:
 	int Nr, Nc;
-	Vect** p;
-	double max_grad;
+	Vect_t<T>** p;
+	T max_grad;
 public:
-	ETF() {
+	ETF_t() {
 		Nr = 1, Nc = 1;
-		p = new Vect*[Nr];
+		p = new Vect_t<T>*[Nr];
 		for (int i = 0; i < Nr; i++)
-			p[i] = new Vect[Nc];
+			p[i] = new Vect_t<T>[Nc];
 		p[0][0].tx = 1.0;
 		p[0][0].ty = 0.0;
 		p[0][0].mag = 1.0;
 		max_grad = 1.0;
 	}
 	;
-	ETF(int i, int j) {
+	ETF_t(int i, int j) {
 		Nr = i, Nc = j;
-		p = new Vect*[Nr];
+		p = new Vect_t<T>*[Nr];
 		for (i = 0; i < Nr; i++)
-			p[i] = new Vect[Nc];
+			p[i] = new Vect_t<T>[Nc];
 		max_grad = 1.0;
 	}
 	;
@@ -37,14 +55,14 @@ public:
 			delete[] p[i];
 		delete[] p;
 	}
-	~ETF() {
+	~ETF_t() {
 		delete_all();
 	}
-	Vect* operator[](int i) {
+	Vect_t<T>* operator[](int i) {
 		return p[i];
 	}
 	;
-	Vect& get(int i, int j) const {
+	Vect_t<T>& get(int i, int j) const {
 		return p[i][j];
 	}
 	int getRow() const {
@@ -56,13 +74,13 @@ public:
 	void init(int i, int j) {
 		delete_all();
 		Nr = i, Nc = j;
-		p = new Vect*[Nr];
+		p = new Vect_t<T>*[Nr];
 		for (i = 0; i < Nr; i++)
-			p[i] = new Vect[Nc];
+			p[i] = new Vect_t<T>[Nc];
 		max_grad = 1.0;
 	}
 	;
-	void copy(ETF& s) {
+	void copy(ETF_t& s) {
 		for (int i = 0; i < Nr; i++)
 			for (int j = 0; j < Nc; j++) {
 				p[i][j].tx = s.p[i][j].tx;
@@ -79,11 +97,36 @@ public:
 	}
 	void set(imatrix& image);
 	void set2(imatrix& image);
+	void set2(imatrix& image, mymatrix& tmp, imatrix& gmag);
+	// Builds the field from the structure tensor instead of set2 and Smooth: the Sobel gradient
+	// products are blurred with a separable Gaussian of this sigma and each tangent is the minor
+	// eigenvector of the blurred tensor, its magnitude the root of the major eigenvalue. Opposite
+	// gradients reinforce each other in the tensor, so no sign test is needed and the smoothing is a
+	// plain convolution; the blur is GaussSmoothSep's. planes is scratch, grown to about 6 image
+	// planes and kept by the caller. The row bands run on threads, 0 for ThreadPool::shared().
+	void setTensor(imatrix& image, double sigma, std::vector<T>& planes, ThreadPool* threads = 0);
 	void Smooth(int half_w, int M);
-	double GetMaxGrad() {
+	void Smooth(int half_w, int M, ETF_t& e2);
+	void Upsample(ETF_t& coarse);
+	void Blend(ETF_t& prev, imatrix& gmag, imatrix& prev_gmag, int change);
+	T GetMaxGrad() {
 		return max_grad;
 	}
 	void normalize();
 };
 
+typedef ETF_t<double> ETF;
+
+// One pass of Smooth on an image_x x image_y field given by its rows. Each tangent of dst in
+// [row_begin, row_end) x [col_begin, col_end) becomes the weighted average of the src tangents up to
+// half_w pixels away along the first index (axis 0) or the second (axis 1). Neighbours are clamped
+// to the field, so a sub-rectangle only matches the whole-field pass where its inputs are valid.
+template<class T>
+void SmoothPass(Vect_t<T>* const * src, Vect_t<T>* const * dst, int image_x, int image_y, int half_w, int axis,
+		int row_begin, int row_end, int col_begin, int col_end);
+
+// Averages factor x factor blocks of image into small, the last row and column of blocks may be
+// partial. small is resized to ceil(rows / factor) x ceil(cols / factor) if needed.
+void DownsampleImage(imatrix& image, int factor, imatrix& small);
+
 #endif
@@ -0,0 +1,36 @@
+#ifndef _CLDBATCH_H_
+#define _CLDBATCH_H_
+
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+// Headless batch processing of image files, for runs over whole catalogues without a window.
+// Images are read and written with imread and imwrite, which OpenCV 2.4 keeps in highgui, but no
+// window or event loop is ever created.
+
+// What each batch thread runs. Every thread gets its own worker, so a worker can keep contexts and
+// buffers from one image to the next without locking.
+class BatchWorker {
+public:
+	virtual ~BatchWorker() {
+	}
+	// Turns the 8-bit BGR image input into output. Returns false if the image cannot be processed.
+	virtual bool process(const cv::Mat& input, cv::Mat& output) = 0;
+};
+
+// Fills paths from input: the image files in it if it is a directory, otherwise the lines of it
+// as a list file, one path per line, blank lines and lines starting with # skipped. Returns false
+// if input cannot be read.
+bool ListBatchInputs(const std::string& input, std::vector<std::string>& paths);
+
+// Processes every path on workers.size() threads, thread k running workers[k], and writes each
+// result to out_dir under the input's file name. out_dir is created if it does not exist. Inputs
+// whose file name an earlier input already has are not processed and count as failed. Prints
+// progress for failures and a summary of images per second and per-image latency (read, process
+// and write) to stdout. Returns the number of images that failed, all of them if out_dir cannot
+// be created.
+int RunBatch(const std::vector<std::string>& paths, const std::string& out_dir, std::vector<BatchWorker*>& workers);
+
+#endif
@@ -0,0 +1,99 @@
+#include "cldcontext.h"
+
+// Gradient magnitude change, in levels of set2's 8-bit magnitude map, above which a temporal ETF
+// ignores the previous frame.
+#define TEMPORAL_CHANGE 32
+
+template<class M>
+static inline void Reserve(M& m, int rows, int cols) {
+	if (m.getRow() != rows || m.getCol() != cols)
+		m.init(rows, cols);
+}
+
+template<class T>
+void CldContext_t<T>::prepare(int rows, int cols) {
+	if (rows == this->rows && cols == this->cols && etf_scale == prepared_scale)
+		return;
+	this->rows = rows;
+	this->cols = cols;
+	prepared_scale = etf_scale;
+	has_prev = false;
+
+	// set2 needs 3 rows and columns, so tiny images get a smaller reduction than asked for
+	run_scale = etf_scale;
+	while (run_scale > 1 && ((rows + run_scale - 1) / run_scale < 3 || (cols + run_scale - 1) / run_scale < 3))
+		run_scale /= 2;
+
+	// The ETF temporaries are only needed at the resolution the ETF is built at.
+	int etf_rows = (rows + run_scale - 1) / run_scale;
+	int etf_cols = (cols + run_scale - 1) / run_scale;
+
+	Reserve(image, rows, cols);
+	Reserve(e, rows, cols);
+	Reserve(e2, etf_rows, etf_cols);
+	Reserve(gradient, etf_rows, etf_cols);
+	Reserve(gmag, etf_rows, etf_cols);
+	if (run_scale > 1) {
+		Reserve(coarse_image, etf_rows, etf_cols);
+		Reserve(coarse_e, etf_rows, etf_cols);
+	}
+}
+
+template<class T>
+void CldContext_t<T>::run(double sigma, double sigma3, double tau, double thres, Options options) {
+	// picks up a scale changed since the last prepare(), keeping the image
+	prepare(image.getRow(), image.getCol());
+
+	options.workspace = &workspace;
+	options.threshold_mode = FDOG_THRESHOLD_GRAY;
+	options.thres = thres;
+
+	if (edge_mode == CLD_EDGES_XDOG) {
+		// the temporal field restarts when the FDoG comes back
+		has_prev = false;
+		GetXDoG(image, sigma, tau, options);
+		return;
+	}
+
+	// the field is built at the reduced resolution if there is one, and the smoothing radius is
+	// scaled down with the image so that it covers the same area
+	ETF_t<T>& field = (run_scale > 1) ? coarse_e : e;
+	int half_w = (4 / run_scale > 1) ? 4 / run_scale : 1;
+	int M = 2;
+
+	if (run_scale > 1)
+		DownsampleImage(image, run_scale, coarse_image);
+	imatrix& etf_image = (run_scale > 1) ? coarse_image : image;
+
+	if (etf_mode == CLD_ETF_TENSOR) {
+		field.setTensor(etf_image, CLD_TENSOR_SIGMA / run_scale, tensor, options.threads);
+	} else {
+		field.set2(etf_image, gradient, gmag);
+
+		if (temporal && has_prev) {
+			field.Blend(prev_e, gmag, prev_gmag, TEMPORAL_CHANGE);
+			M = 1;
+		}
+		field.Smooth(half_w, M, e2);
+
+		if (temporal) {
+			int etf_rows = field.getRow();
+			int etf_cols = field.getCol();
+			Reserve(prev_e, etf_rows, etf_cols);
+			Reserve(prev_gmag, etf_rows, etf_cols);
+			prev_e.copy(field);
+			for (int i = 0; i < etf_rows; i++)
+				for (int j = 0; j < etf_cols; j++)
+					prev_gmag[i][j] = gmag[i][j];
+			has_prev = true;
+		}
+	}
+
+	if (run_scale > 1)
+		e.Upsample(coarse_e);
+
+	GetFDoG(image, e, sigma, sigma3, tau, options);
+}
+
+template class CldContext_t<float>;
+template class CldContext_t<double>;
@@ -0,0 +1,120 @@
+#ifndef _CLDCONTEXT_H_
+#define _CLDCONTEXT_H_
+
+#include "imatrix.h"
+#include "ETF.h"
+#include "myvec.h"
+#include "fdog.h"
+
+// Edge detectors CldContext_t::run can use. FDOG is Kang's flow-based DoG over the ETF, XDOG the
+// isotropic GetXDoG, which skips the ETF and is several times cheaper.
+#define CLD_EDGES_FDOG 0
+#define CLD_EDGES_XDOG 1
+
+// Ways CldContext_t::run can build the tangent field: set2 and Smooth(4, 2), or ETF_t::setTensor
+// with a blur of CLD_TENSOR_SIGMA.
+#define CLD_ETF_SMOOTH 0
+#define CLD_ETF_TENSOR 1
+#define CLD_TENSOR_SIGMA 2.0
+
+// Everything one coherent line drawing pass needs between frames: the input plane, the edge tangent
+// flow with its smoothing and gradient temporaries, and the FDoG workspace with its cached kernels.
+// Buffers are sized by prepare() and only reallocated when the resolution changes, so a video loop
+// that keeps one context does not allocate per frame.
+template<class T>
+class CldContext_t {
+private:
+	int rows, cols;
+	int etf_scale, prepared_scale;
+	int run_scale; // etf_scale, reduced by prepare() until the coarse image has 3 rows and columns
+	int edge_mode;
+	int etf_mode;
+	ETF_t<T> e, e2;
+	mymatrix gradient;
+	imatrix gmag;
+	imatrix coarse_image;
+	ETF_t<T> coarse_e;
+	bool temporal, has_prev;
+	ETF_t<T> prev_e;
+	imatrix prev_gmag;
+	std::vector<T> tensor; // setTensor's planes
+	FDoGWorkspace_t<T> workspace;
+public:
+	typedef FDoGOptions_t<T> Options;
+
+	imatrix image; // grey input, replaced by the line drawing after run()
+
+	CldContext_t() :
+			rows(0), cols(0), etf_scale(1), prepared_scale(1), run_scale(1), edge_mode(CLD_EDGES_FDOG), etf_mode(CLD_ETF_SMOOTH), temporal(false), has_prev(false) {
+	}
+
+	// Sizes the buffers for a rows x cols image, does nothing if they already have that size.
+	void prepare(int rows, int cols);
+
+	// Builds the ETF on the image reduced by this factor (1, 2 or 4) and upsamples it, see
+	// ETF_t::Upsample. The tangent field is smooth by design, so a reduced field costs about
+	// 1 / scale^2 of the full one for a small change in the lines. Images that would reduce to
+	// fewer than 3 rows or columns get the largest factor that does not. Any other factor is
+	// refused: returns false and keeps the current scale.
+	bool setETFScale(int scale) {
+		if (!isETFScale(scale))
+			return false;
+		etf_scale = scale;
+		return true;
+	}
+	static bool isETFScale(int scale) {
+		return scale == 1 || scale == 2 || scale == 4;
+	}
+	int getETFScale() const {
+		return etf_scale;
+	}
+
+	// CLD_EDGES_FDOG or CLD_EDGES_XDOG, can be changed between any two runs.
+	void setEdgeMode(int mode) {
+		edge_mode = mode;
+	}
+	int getEdgeMode() const {
+		return edge_mode;
+	}
+
+	// CLD_ETF_SMOOTH or CLD_ETF_TENSOR. The tensor field is not carried between frames, setTemporal
+	// only applies to CLD_ETF_SMOOTH.
+	void setETFMode(int mode) {
+		etf_mode = mode;
+		has_prev = false;
+	}
+	int getETFMode() const {
+		return etf_mode;
+	}
+
+	// For video: seeds each frame's ETF with the previous frame's smoothed field where the gradient
+	// magnitude has not changed (see ETF_t::Blend) and smooths it once instead of twice. The field
+	// carries over between frames, which also keeps the lines steadier. Restarts on a size change.
+	void setTemporal(bool on) {
+		temporal = on;
+		has_prev = false;
+	}
+	bool getTemporal() const {
+		return temporal;
+	}
+
+	// Runs set2, Smooth(4, 2), GetFDoG and GrayThresholding on image. The threshold is fused into
+	// GetFDoG's epilogue. In CLD_EDGES_XDOG mode GetXDoG replaces everything before the threshold
+	// and sigma3 is not used. In CLD_ETF_TENSOR mode setTensor replaces set2 and Smooth.
+	void run(double sigma, double sigma3, double tau, double thres, Options options = Options());
+
+	ETF_t<T>& getETF() {
+		return e;
+	}
+	int getRow() const {
+		return rows;
+	}
+	int getCol() const {
+		return cols;
+	}
+};
+
+// Production contexts run in float, CldContext_t<double> gives the reference result.
+typedef CldContext_t<float> CldContext;
+
+#endif
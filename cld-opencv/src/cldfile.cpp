@@ -0,0 +1,189 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "cldfile.h"
+
+MappedFile::MappedFile() :
+#ifdef _WIN32
+		file(INVALID_HANDLE_VALUE), mapping(0),
+#else
+		file(-1),
+#endif
+		writable(false), size(0), view(0), view_length(0) {
+}
+
+MappedFile::~MappedFile() {
+	close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const char* path, bool write, long long size) {
+	close();
+	file = CreateFileA(path, write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, NULL,
+			write ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	if (!write) {
+		LARGE_INTEGER length;
+		if (!GetFileSizeEx(file, &length)) {
+			close();
+			return false;
+		}
+		size = length.QuadPart;
+	}
+	// a mapping of the full size also extends a new file to it
+	mapping = CreateFileMappingA(file, NULL, write ? PAGE_READWRITE : PAGE_READONLY, (DWORD) (size >> 32),
+			(DWORD) size, NULL);
+	if (!mapping) {
+		close();
+		return false;
+	}
+	this->size = size;
+	writable = write;
+	return true;
+}
+
+void MappedFile::close() {
+	unmap();
+	if (mapping)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	mapping = 0;
+	file = INVALID_HANDLE_VALUE;
+	size = 0;
+}
+
+unsigned char* MappedFile::map(long long offset, size_t length) {
+	unmap();
+	if (!mapping || offset < 0 || offset + (long long) length > size)
+		return 0;
+
+	// views start on the allocation granularity, usually 64 KB
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	long long start = offset - offset % info.dwAllocationGranularity;
+	view_length = (size_t) (offset - start) + length;
+	view = MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, (DWORD) (start >> 32), (DWORD) start,
+			view_length);
+	if (!view)
+		return 0;
+	return (unsigned char*) view + (offset - start);
+}
+
+void MappedFile::unmap() {
+	if (view)
+		UnmapViewOfFile(view);
+	view = 0;
+	view_length = 0;
+}
+
+#else
+
+bool MappedFile::open(const char* path, bool write, long long size) {
+	close();
+	file = ::open(path, write ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+	if (file < 0)
+		return false;
+	if (write) {
+		if (ftruncate(file, (off_t) size) != 0) {
+			close();
+			return false;
+		}
+	} else {
+		struct stat st;
+		if (fstat(file, &st) != 0) {
+			close();
+			return false;
+		}
+		size = st.st_size;
+	}
+	this->size = size;
+	writable = write;
+	return true;
+}
+
+void MappedFile::close() {
+	unmap();
+	if (file >= 0)
+		::close(file);
+	file = -1;
+	size = 0;
+}
+
+unsigned char* MappedFile::map(long long offset, size_t length) {
+	unmap();
+	if (file < 0 || offset < 0 || offset + (long long) length > size || length == 0)
+		return 0;
+
+	// mappings start on a page
+	long long page = sysconf(_SC_PAGESIZE);
+	long long start = offset - offset % page;
+	view_length = (size_t) (offset - start) + length;
+	view = mmap(0, view_length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, file, (off_t) start);
+	if (view == MAP_FAILED) {
+		view = 0;
+		return 0;
+	}
+	return (unsigned char*) view + (offset - start);
+}
+
+void MappedFile::unmap() {
+	if (view)
+		munmap(view, view_length);
+	view = 0;
+	view_length = 0;
+}
+
+#endif
+
+bool RunCLDOnRawFile(CldTiler& tiler, const char* in_path, const char* out_path, int rows, int cols, double sigma,
+		double sigma3, double tau, double thres) {
+	MappedFile in, out;
+	long long bytes = (long long) rows * cols;
+
+	if (rows < 3 || cols < 3)
+		return false;
+	if (!in.open(in_path) || in.getSize() < bytes || !out.open(out_path, true, bytes))
+		return false;
+
+	tiler.prepare(sigma, sigma3);
+	int halo = tiler.getHalo();
+	// whole rows of tiles per strip, so the tiles do not depend on where the strips fall
+	int tile = tiler.getTileSize();
+	int strip = (CLD_FILE_STRIP_ROWS + tile - 1) / tile * tile;
+
+	// pass 0 and 1 find set2's maxima, pass 2 runs the tiles
+	for (int pass = 0; pass < 3; pass++) {
+		for (int r0 = 0; r0 < rows; r0 += strip) {
+			int r1 = (r0 + strip < rows) ? r0 + strip : rows;
+			int w0 = (r0 - halo > 0) ? r0 - halo : 0;
+			int w1 = (r1 + halo < rows) ? r1 + halo : rows;
+			const unsigned char* src = in.map((long long) w0 * cols, (size_t) (w1 - w0) * cols);
+			if (!src)
+				return false;
+
+			if (pass == 0) {
+				tiler.measureMagnitude(src, cols, w0, rows, cols, r0, r1);
+			} else if (pass == 1) {
+				tiler.measureTangent(src, cols, w0, rows, cols, r0, r1);
+			} else {
+				unsigned char* dst = out.map((long long) r0 * cols, (size_t) (r1 - r0) * cols);
+				if (!dst)
+					return false;
+				tiler.runTiles(src, cols, w0, dst, cols, r0, rows, cols, r0, r1, tau, thres);
+				out.unmap();
+			}
+		}
+	}
+	return true;
+}
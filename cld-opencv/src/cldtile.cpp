@@ -0,0 +1,319 @@
+#include <cmath>
+
+#include "cldtile.h"
+
+// Smoothing of CldContext_t::run at ETF scale 1, Smooth(4, 2).
+#define TILE_SMOOTH_HALF_W 4
+#define TILE_SMOOTH_M 2
+
+static inline int ClampIndex(int v, int lo, int hi) {
+	return (v < lo) ? lo : ((v > hi) ? hi : v);
+}
+
+// Sobel magnitude of the interior pixel (i, j), computed in double as set2 does. src holds image
+// rows from src_r0.
+static inline double SobelMagnitude(const unsigned char* src, int src_step, int src_r0, int i, int j) {
+	const unsigned char* a = src + (size_t) (i - 1 - src_r0) * src_step;
+	const unsigned char* b = a + src_step;
+	const unsigned char* c = b + src_step;
+	double gx = (c[j - 1] + 2 * (double) c[j] + c[j + 1] - a[j - 1] - 2 * (double) a[j] - a[j + 1]) / 1020.;
+	double gy = (a[j + 1] + 2 * (double) b[j + 1] + c[j + 1] - a[j - 1] - 2 * (double) b[j - 1] - c[j - 1]) / 1020.;
+	return sqrt(gx * gx + gy * gy);
+}
+
+// set2's 8-bit gradient magnitude at any pixel. set2 copies the border from the nearest interior
+// pixel (the corners average two equal values), so clamping to the interior gives the same value.
+static inline int GradientLevel(const unsigned char* src, int src_step, int src_r0, int rows, int cols, int i, int j,
+		double max_mag) {
+	double t = SobelMagnitude(src, src_step, src_r0, ClampIndex(i, 1, rows - 2), ClampIndex(j, 1, cols - 2)) / max_mag;
+	return (int) round(t * 255.0);
+}
+
+// set2's tangent before normalisation, from rows a, b, c of the magnitude map around column j.
+template<class T>
+static inline void SobelTangent(const unsigned char* a, const unsigned char* b, const unsigned char* c, int j,
+		Vect_t<T>& v) {
+	T MAX_VAL = 1020.;
+	T tx = (c[j - 1] + 2 * (T) c[j] + c[j + 1] - a[j - 1] - 2 * (T) a[j] - a[j + 1]) / MAX_VAL;
+	T ty = (a[j + 1] + 2 * (T) b[j + 1] + c[j + 1] - a[j - 1] - 2 * (T) b[j - 1] - c[j - 1]) / MAX_VAL;
+	v.tx = -ty;
+	v.ty = tx;
+	v.mag = sqrt(v.tx * v.tx + v.ty * v.ty);
+}
+
+template<class T>
+CldTiler_t<T>::~CldTiler_t() {
+	for (size_t k = 0; k < scratch.size(); k++)
+		delete scratch[k];
+}
+
+template<class T>
+CldTileScratch_t<T>* CldTiler_t<T>::acquire() {
+	std::lock_guard<std::mutex> guard(lock);
+	if (idle.empty()) {
+		scratch.push_back(new CldTileScratch_t<T>);
+		idle.reserve(scratch.size());
+		return scratch.back();
+	}
+	CldTileScratch_t<T>* s = idle.back();
+	idle.pop_back();
+	return s;
+}
+
+template<class T>
+void CldTiler_t<T>::release(CldTileScratch_t<T>* s) {
+	std::lock_guard<std::mutex> guard(lock);
+	idle.push_back(s);
+}
+
+template<class T>
+void CldTiler_t<T>::prepare(double sigma, double sigma3) {
+	max_mag = -1.;
+	max_grad = -1.;
+
+	if (this->sigma != sigma) {
+		MakeGaussianVector(sigma, GAU1);
+		MakeGaussianVector(sigma * 1.6, GAU2);
+		this->sigma = sigma;
+
+		MakeDoGWeights(GAU1, GAU2, w1, w2, w_sum1, w_sum2);
+	}
+	if (this->sigma3 != sigma3) {
+		MakeGaussianVector(sigma3, GAU3);
+		this->sigma3 = sigma3;
+	}
+}
+
+// The tiles read furthest: the flow DoG's and Smooth's reach, then the magnitude map's Sobel and
+// the Sobel of the image under it. The DoG's own samples stay within the flow DoG's reach plus
+// half_w2 + 1, which is less.
+template<class T>
+int CldTiler_t<T>::getHalo() const {
+	return GAU3.N + TILE_SMOOTH_HALF_W * TILE_SMOOTH_M + 2;
+}
+
+template<class T>
+void CldTiler_t<T>::measureMagnitude(const unsigned char* src, int src_step, int src_r0, int rows, int cols,
+		int row_begin, int row_end, ThreadPool* threads) {
+	ThreadPool& pool = threads ? *threads : ThreadPool::shared();
+
+	// interior rows only, set2 copies the border
+	row_begin = ClampIndex(row_begin, 1, rows - 1);
+	row_end = ClampIndex(row_end, 1, rows - 1);
+	if (row_end <= row_begin)
+		return;
+
+	pool.parallelFor(row_end - row_begin, CLD_BAND_ROWS, [&](int band_begin, int band_end) {
+		int i, j;
+		double m = -1., v;
+		for (i = row_begin + band_begin; i < row_begin + band_end; i++) {
+			for (j = 1; j < cols - 1; j++) {
+				v = SobelMagnitude(src, src_step, src_r0, i, j);
+				if (v > m)
+					m = v;
+			}
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		if (m > max_mag)
+			max_mag = m;
+	});
+}
+
+// Rebuilds the magnitude map one band at a time, with a row above and below for the Sobel.
+template<class T>
+void CldTiler_t<T>::measureTangent(const unsigned char* src, int src_step, int src_r0, int rows, int cols,
+		int row_begin, int row_end, ThreadPool* threads) {
+	ThreadPool& pool = threads ? *threads : ThreadPool::shared();
+
+	row_begin = ClampIndex(row_begin, 1, rows - 1);
+	row_end = ClampIndex(row_end, 1, rows - 1);
+	if (row_end <= row_begin)
+		return;
+
+	pool.parallelFor(row_end - row_begin, CLD_BAND_ROWS, [&](int band_begin, int band_end) {
+		int i, j;
+		Vect_t<T> v;
+		T m = (T) max_mag; // set2 starts from the first normalisation
+		CldTileScratch_t<T>* s = acquire();
+
+		// magnitude rows first - 1..last + 1 for the interior rows first..last
+		int first = row_begin + band_begin;
+		int n = band_end - band_begin + 2;
+		s->gmag.resize((size_t) n * cols);
+		unsigned char* g = &s->gmag[0];
+		for (i = 0; i < n; i++) {
+			for (j = 0; j < cols; j++) {
+				g[i * cols + j] = GradientLevel(src, src_step, src_r0, rows, cols, first - 1 + i, j, max_mag);
+			}
+		}
+		for (i = 1; i < n - 1; i++) {
+			for (j = 1; j < cols - 1; j++) {
+				SobelTangent(g + (i - 1) * cols, g + i * cols, g + (i + 1) * cols, j, v);
+				if (v.mag > m)
+					m = v.mag;
+			}
+		}
+		release(s);
+
+		std::lock_guard<std::mutex> guard(lock);
+		if (m > max_grad)
+			max_grad = m;
+	});
+}
+
+template<class T>
+void CldTiler_t<T>::runTile(const unsigned char* src, int src_step, int src_r0, unsigned char* dst, int dst_step,
+		int dst_r0, int rows, int cols, int tile_r0, int tile_c0, double tau, const FDoGOptions_t<T>& options,
+		CldTileScratch_t<T>& s) {
+	int i, j, p;
+
+	int half_w2 = GAU2.getMax() - 1;
+	int half_l = GAU3.getMax() - 1;
+	int half_w = TILE_SMOOTH_HALF_W;
+
+	// tile
+	int tr0 = tile_r0, tr1 = ClampIndex(tile_r0 + tile, 0, rows);
+	int tc0 = tile_c0, tc1 = ClampIndex(tile_c0 + tile, 0, cols);
+	// flow DoG reach, the columns are kept on the DoG's blocks of four from column 0
+	int reach = half_l + 1;
+	int fr0 = ClampIndex(tr0 - reach, 0, rows), fr1 = ClampIndex(tr1 + reach, 0, rows);
+	int fc0 = ClampIndex(tc0 - reach, 0, cols), fc1 = ClampIndex(tc1 + reach, 0, cols);
+	fc0 -= fc0 % 4;
+	fc1 = ClampIndex((fc1 + 3) / 4 * 4, 0, cols);
+	int fh = fr1 - fr0, fw = fc1 - fc0;
+	// Smooth's reach
+	reach = half_w * TILE_SMOOTH_M;
+	int sr0 = ClampIndex(fr0 - reach, 0, rows), sr1 = ClampIndex(fr1 + reach, 0, rows);
+	int sc0 = ClampIndex(fc0 - reach, 0, cols), sc1 = ClampIndex(fc1 + reach, 0, cols);
+	int sh = sr1 - sr0, sw = sc1 - sc0;
+	// set2's Sobel on the magnitude map
+	int gr0 = ClampIndex(sr0 - 1, 0, rows), gr1 = ClampIndex(sr1 + 1, 0, rows);
+	int gc0 = ClampIndex(sc0 - 1, 0, cols), gc1 = ClampIndex(sc1 + 1, 0, cols);
+	int gw = gc1 - gc0;
+	// DoG samples, see the margin in DirectionalDoGRow
+	reach = half_w2 + 1;
+	int dr0 = ClampIndex(fr0 - reach, 0, rows), dr1 = ClampIndex(fr1 + reach, 0, rows);
+	int dc0 = ClampIndex(fc0 - reach, 0, cols), dc1 = ClampIndex(fc1 + reach, 0, cols);
+	int dw = dc1 - dc0;
+
+	// set2
+	s.gmag.resize((size_t) (gr1 - gr0) * gw);
+	unsigned char* g = &s.gmag[0];
+	for (i = gr0; i < gr1; i++) {
+		for (j = gc0; j < gc1; j++) {
+			g[(i - gr0) * gw + j - gc0] = GradientLevel(src, src_step, src_r0, rows, cols, i, j, max_mag);
+		}
+	}
+
+	s.etf.resize((size_t) sh * sw);
+	s.etf2.resize((size_t) sh * sw);
+	s.rows.resize(sh);
+	s.rows2.resize(sh);
+	for (i = 0; i < sh; i++) {
+		s.rows[i] = &s.etf[i * sw];
+		s.rows2[i] = &s.etf2[i * sw];
+	}
+	for (i = sr0; i < sr1; i++) {
+		int ci = ClampIndex(i, 1, rows - 2) - gr0;
+		Vect_t<T>* e = s.rows[i - sr0];
+		for (j = sc0; j < sc1; j++) {
+			Vect_t<T>& v = e[j - sc0];
+			SobelTangent(g + (ci - 1) * gw, g + ci * gw, g + (ci + 1) * gw, ClampIndex(j, 1, cols - 2) - gc0, v);
+			make_unit(v.tx, v.ty);
+			v.mag /= max_grad;
+		}
+	}
+	s.etf2 = s.etf;
+
+	// Smooth, each pass only produces what the later passes read: the flow rectangle for the last
+	// one, and half_w more along its axis for the one before
+	int need[2 * TILE_SMOOTH_M][4];
+	int r0 = fr0 - sr0, r1 = fr1 - sr0, c0 = fc0 - sc0, c1 = fc1 - sc0;
+	for (p = 2 * TILE_SMOOTH_M - 1; p >= 0; p--) {
+		need[p][0] = r0, need[p][1] = r1, need[p][2] = c0, need[p][3] = c1;
+		if (p % 2 == 0) {
+			r0 = ClampIndex(r0 - half_w, 0, sh);
+			r1 = ClampIndex(r1 + half_w, 0, sh);
+		} else {
+			c0 = ClampIndex(c0 - half_w, 0, sw);
+			c1 = ClampIndex(c1 + half_w, 0, sw);
+		}
+	}
+	Vect_t<T>** cur = &s.rows[0];
+	Vect_t<T>** next = &s.rows2[0];
+	for (p = 0; p < 2 * TILE_SMOOTH_M; p++) {
+		SmoothPass(cur, next, sh, sw, half_w, p % 2, need[p][0], need[p][1], need[p][2], need[p][3]);
+		Vect_t<T>** t = cur;
+		cur = next;
+		next = t;
+	}
+
+	// directional DoG
+	s.src.resize((size_t) (dr1 - dr0) * dw);
+	for (i = dr0; i < dr1; i++) {
+		const unsigned char* in = src + (size_t) (i - src_r0) * src_step;
+		float* out = &s.src[(i - dr0) * dw];
+		for (j = dc0; j < dc1; j++)
+			out[j - dc0] = (float) in[j];
+	}
+	s.dog.resize((size_t) fh * fw);
+	s.field.resize((size_t) fh * fw);
+	for (i = fr0; i < fr1; i++) {
+		const Vect_t<T>* e = &cur[i - sr0][fc0 - sc0];
+		T* dog = &s.dog[(i - fr0) * fw];
+		DirectionalDoGRow(&s.src[0], dr0, dc0, dw, rows, cols, i, fc0, fc1, e, dog, &w1[0], &w2[0], w_sum1, w_sum2,
+				half_w2, tau, GAU1, GAU2);
+		FlowSample_t<T>* f = &s.field[(i - fr0) * fw];
+		for (j = 0; j < fw; j++) {
+			f[j].tx = e[j].tx;
+			f[j].ty = e[j].ty;
+			f[j].dog = dog[j];
+		}
+	}
+
+	// flow DoG and GetFDoG's epilogue for the tile itself
+	s.line.resize(tc1 - tc0);
+	for (i = tr0; i < tr1; i++) {
+		FlowDoGRow(&s.field[0], fr0, fc0, fw, rows, cols, i, tc0, tc1, GAU3, 0, &s.line[0]);
+		FDoGOutputRow(&s.line[0], tc1 - tc0, dst + (size_t) (i - dst_r0) * dst_step + tc0, options);
+	}
+}
+
+template<class T>
+void CldTiler_t<T>::runTiles(const unsigned char* src, int src_step, int src_r0, unsigned char* dst, int dst_step,
+		int dst_r0, int rows, int cols, int row_begin, int row_end, double tau, double thres, Options options) {
+	ThreadPool& pool = options.threads ? *options.threads : ThreadPool::shared();
+
+	options.threshold_mode = FDOG_THRESHOLD_GRAY;
+	options.thres = thres;
+
+	int tile_r0 = row_begin / tile;
+	int tile_rows = (row_end + tile - 1) / tile - tile_r0;
+	int tile_cols = (cols + tile - 1) / tile;
+	if (tile_rows <= 0)
+		return;
+	pool.parallelFor(tile_rows * tile_cols, 1, [&](int begin, int end) {
+		CldTileScratch_t<T>* s = acquire();
+		for (int t = begin; t < end; t++) {
+			runTile(src, src_step, src_r0, dst, dst_step, dst_r0, rows, cols, (tile_r0 + t / tile_cols) * tile,
+					(t % tile_cols) * tile, tau, options, *s);
+		}
+		release(s);
+	});
+}
+
+template<class T>
+bool CldTiler_t<T>::run(const unsigned char* src, int src_step, unsigned char* dst, int dst_step, int rows, int cols,
+		double sigma, double sigma3, double tau, double thres, Options options) {
+	if (rows < 3 || cols < 3)
+		return false;
+
+	prepare(sigma, sigma3);
+	measureMagnitude(src, src_step, 0, rows, cols, 0, rows, options.threads);
+	measureTangent(src, src_step, 0, rows, cols, 0, rows, options.threads);
+	runTiles(src, src_step, 0, dst, dst_step, 0, rows, cols, 0, rows, tau, thres, options);
+	return true;
+}
+
+template class CldTiler_t<float>;
+template class CldTiler_t<double>;
@@ -0,0 +1,100 @@
+#ifndef _CLDTILE_H_
+#define _CLDTILE_H_
+
+#include <mutex>
+#include <vector>
+
+#include "ETF.h"
+#include "myvec.h"
+#include "fdog.h"
+#include "threadpool.h"
+
+// Default edge length of a CldTiler tile in pixels.
+#define CLD_TILE_SIZE 128
+
+// Scratch of one tile, sized for the largest tile and halo seen. Handed to one band at a time.
+template<class T>
+struct CldTileScratch_t {
+	std::vector<unsigned char> gmag; // set2's 8-bit gradient magnitude
+	std::vector<Vect_t<T> > etf, etf2; // tangent field and Smooth's second buffer
+	std::vector<Vect_t<T>*> rows, rows2; // row pointers into etf and etf2 for SmoothPass
+	std::vector<float> src; // input plane as floats for the DoG
+	std::vector<T> dog;
+	std::vector<FlowSample_t<T> > field;
+	std::vector<T> line; // flow DoG of one tile row
+};
+
+// Runs the chain of CldContext_t::run (set2, Smooth(4, 2), the directional DoG, the flow DoG and the
+// threshold) tile by tile, so the tangent field, the DoG and the flow samples only ever exist for
+// one tile and its halo and stay in cache between stages. Each tile is extended by the flow DoG's
+// reach (half_l + 1), then by Smooth's (half_w * M) and then by set2's Sobel, and the stages are run
+// on those shrinking rectangles; only the tile itself is written out. The two maxima set2 normalises
+// by are global, so a streaming pre-pass over the image finds them first.
+//
+// The input and output are 8-bit planes given by their first byte and row step, so an image that
+// is not in an imatrix (or not in memory, see the out-of-core mode) can be processed directly. The
+// result is that of CldContext_t::run with ETF scale 1 and no temporal field; angle_bins, sparse and
+// workspace in the options are not used.
+template<class T>
+class CldTiler_t {
+private:
+	int tile;
+	double max_mag; // largest Sobel magnitude of the image, set2's first normalisation
+	T max_grad; // largest tangent magnitude, set2's second normalisation
+	double sigma, sigma3; // sigmas the kernels below were built for, 0 if not built yet
+	myvec_t<T> GAU1, GAU2, GAU3;
+	std::vector<float> w1, w2;
+	float w_sum1, w_sum2;
+
+	std::mutex lock;
+	std::vector<CldTileScratch_t<T>*> scratch; // all scratch ever made, for the destructor
+	std::vector<CldTileScratch_t<T>*> idle; // scratch not in use by a band
+
+	CldTileScratch_t<T>* acquire();
+	void release(CldTileScratch_t<T>* s);
+	void runTile(const unsigned char* src, int src_step, int src_r0, unsigned char* dst, int dst_step, int dst_r0,
+			int rows, int cols, int tile_r0, int tile_c0, double tau, const FDoGOptions_t<T>& options,
+			CldTileScratch_t<T>& s);
+public:
+	typedef FDoGOptions_t<T> Options;
+
+	CldTiler_t() :
+			tile(CLD_TILE_SIZE), max_mag(1.0), max_grad(1.0), sigma(0.0), sigma3(0.0), w_sum1(0.0f), w_sum2(0.0f) {
+	}
+	~CldTiler_t();
+
+	void setTileSize(int size) {
+		tile = (size > 16) ? size : 16;
+	}
+	int getTileSize() const {
+		return tile;
+	}
+
+	// Writes the line drawing of the rows x cols plane src into dst, which must not overlap src.
+	// Both need at least 3 rows and 3 columns, for smaller images run returns false and writes
+	// nothing. The threshold options apply as in GetFDoG, threshold_mode is forced to
+	// FDOG_THRESHOLD_GRAY with thres like CldContext_t::run.
+	bool run(const unsigned char* src, int src_step, unsigned char* dst, int dst_step, int rows, int cols,
+			double sigma, double sigma3, double tau, double thres, Options options = Options());
+
+	// The steps of run(), for images that are only available a window of rows at a time. Each takes
+	// the window as src, whose first row is image row src_r0, and handles the image rows
+	// [row_begin, row_end); the window must hold those rows and the ones they read around them.
+	// Start each image with prepare(), which builds the kernels and clears the maxima, find the
+	// maxima with measureMagnitude() and then measureTangent() over all rows, then run the tiles with
+	// runTiles(). getHalo() is the number of rows any step may read above and below its range.
+	void prepare(double sigma, double sigma3);
+	int getHalo() const;
+	void measureMagnitude(const unsigned char* src, int src_step, int src_r0, int rows, int cols, int row_begin,
+			int row_end, ThreadPool* threads = 0);
+	void measureTangent(const unsigned char* src, int src_step, int src_r0, int rows, int cols, int row_begin,
+			int row_end, ThreadPool* threads = 0);
+	// row_begin and row_end are multiples of the tile size or rows, dst holds image rows
+	// [row_begin, row_end) from dst_r0.
+	void runTiles(const unsigned char* src, int src_step, int src_r0, unsigned char* dst, int dst_step, int dst_r0,
+			int rows, int cols, int row_begin, int row_end, double tau, double thres, Options options = Options());
+};
+
+typedef CldTiler_t<float> CldTiler;
+
+#endif
@@ -0,0 +1,21 @@
+#include "fastmath.h"
+
+static bool fast_math = false;
+
+void SetFastMath(bool on) {
+	fast_math = on;
+}
+
+bool GetFastMath() {
+	return fast_math;
+}
+
+void tanhfv_fast(const float* x, int n, float* r) {
+	int i = 0;
+#ifdef FASTMATH_USE_SSE2
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(r + i, tanhf_fast_ps(_mm_loadu_ps(x + i)));
+#endif
+	for (; i < n; i++)
+		r[i] = tanhf_fast(x[i]);
+}
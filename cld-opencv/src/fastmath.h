@@ -0,0 +1,151 @@
+#ifndef _FASTMATH_H_
+#define _FASTMATH_H_
+
+#include <cmath>
+
+// SSE2 is always available on x64 and on x86 builds with /arch:SSE2 or -msse2.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FASTMATH_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+// Polynomial approximations of the transcendentals in the CLD inner loops, after the approach of
+// camshift_neon's math_*.cpp: range reduction by the float exponent bits, then a short polynomial.
+// Each has a scalar version and, with SSE2, a four-wide _ps version that agrees to a rounding. The
+// stages use them when fast math is switched on and call <cmath> otherwise, so the default output
+// is unchanged. The errors below were measured against the double functions.
+
+// Switches the CLD stages between <cmath> (false, the default) and the functions below. Set it
+// before processing starts, it is read once per row.
+void SetFastMath(bool on);
+bool GetFastMath();
+
+// Coefficients of exp(r) for |r| <= ln(2) / 2, Taylor to degree 6.
+#define FASTMATH_EXP_C2 0.5f
+#define FASTMATH_EXP_C3 0.16666667f
+#define FASTMATH_EXP_C4 0.041666668f
+#define FASTMATH_EXP_C5 0.0083333338f
+#define FASTMATH_EXP_C6 0.0013888889f
+
+/*
+Test func : expf_fast(x)
+Test Range: -87 < x < 88
+Peak Error: ~0.000025% relative
+RMS  Error: ~0.000004%
+*/
+inline float expf_fast(float x) {
+	union {
+		float f;
+		int i;
+	} a;
+
+	if (x > 88.0f)
+		x = 88.0f;
+	else if (x < -87.0f)
+		x = -87.0f;
+
+	// x = n * ln(2) + r, exp(x) = 2^n * exp(r)
+	float n = floorf(x * 1.44269504f + 0.5f);
+	float r = x - n * 0.693359375f + n * 2.12194440e-4f;
+	float p = FASTMATH_EXP_C5 + r * FASTMATH_EXP_C6;
+	p = FASTMATH_EXP_C4 + r * p;
+	p = FASTMATH_EXP_C3 + r * p;
+	p = FASTMATH_EXP_C2 + r * p;
+	p = 1.0f + r * (1.0f + r * p);
+	a.i = ((int) n + 127) << 23;
+	return p * a.f;
+}
+
+/*
+Test func : tanhf_fast(x)
+Test Range: -10 < x < 10
+Peak Error: ~0.0000002 absolute
+RMS  Error: ~0.00000005 absolute
+Notes     : computed as 1 - 2 / (exp(2x) + 1), the error is absolute near 0
+*/
+inline float tanhf_fast(float x) {
+	if (x > 9.0f)
+		return 1.0f;
+	if (x < -9.0f)
+		return -1.0f;
+	return 1.0f - 2.0f / (expf_fast(2.0f * x) + 1.0f);
+}
+
+/*
+Test func : rsqrtf_fast(x)
+Test Range: 1e-30 < x < 1e30
+Peak Error: ~0.000025% relative
+RMS  Error: ~0.000005%
+Notes     : hardware estimate (or the 0x5F3759DF bit trick without SSE2) and Newton steps
+*/
+inline float rsqrtf_fast(float x) {
+#ifdef FASTMATH_USE_SSE2
+	float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+	return y * (1.5f - 0.5f * x * y * y);
+#else
+	union {
+		float f;
+		int i;
+	} a;
+	a.f = x;
+	a.i = 0x5F3759DF - (a.i >> 1);
+	a.f = a.f * (1.5f - 0.5f * x * a.f * a.f);
+	a.f = a.f * (1.5f - 0.5f * x * a.f * a.f);
+	return a.f * (1.5f - 0.5f * x * a.f * a.f);
+#endif
+}
+
+#ifdef FASTMATH_USE_SSE2
+
+inline __m128 expf_fast_ps(__m128 x) {
+	x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-87.0f)), _mm_set1_ps(88.0f));
+	// floor(y + 0.5) by truncation, corrected where the truncation rounded up
+	__m128 t = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504f)), _mm_set1_ps(0.5f));
+	__m128 n = _mm_cvtepi32_ps(_mm_cvttps_epi32(t));
+	n = _mm_sub_ps(n, _mm_and_ps(_mm_cmpgt_ps(n, t), _mm_set1_ps(1.0f)));
+	__m128 r = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(0.693359375f)));
+	r = _mm_add_ps(r, _mm_mul_ps(n, _mm_set1_ps(2.12194440e-4f)));
+	__m128 p = _mm_add_ps(_mm_set1_ps(FASTMATH_EXP_C5), _mm_mul_ps(r, _mm_set1_ps(FASTMATH_EXP_C6)));
+	p = _mm_add_ps(_mm_set1_ps(FASTMATH_EXP_C4), _mm_mul_ps(r, p));
+	p = _mm_add_ps(_mm_set1_ps(FASTMATH_EXP_C3), _mm_mul_ps(r, p));
+	p = _mm_add_ps(_mm_set1_ps(FASTMATH_EXP_C2), _mm_mul_ps(r, p));
+	p = _mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(r, p));
+	p = _mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(r, p));
+	__m128i e = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(n), _mm_set1_epi32(127)), 23);
+	return _mm_mul_ps(p, _mm_castsi128_ps(e));
+}
+
+inline __m128 tanhf_fast_ps(__m128 x) {
+	x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-9.0f)), _mm_set1_ps(9.0f));
+	__m128 e = expf_fast_ps(_mm_add_ps(x, x));
+	return _mm_sub_ps(_mm_set1_ps(1.0f), _mm_div_ps(_mm_set1_ps(2.0f), _mm_add_ps(e, _mm_set1_ps(1.0f))));
+}
+
+inline __m128 rsqrtf_fast_ps(__m128 x) {
+	__m128 y = _mm_rsqrt_ps(x);
+	__m128 xyy = _mm_mul_ps(_mm_mul_ps(x, y), y);
+	return _mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(_mm_set1_ps(0.5f), xyy)));
+}
+
+#endif
+
+/*
+function:	tanhfv_fast
+return: 	tanhf_fast evaluated at x[i]
+expression: r[i] = tanh(x[i])
+notes:		r and x can be the same memory location.
+*/
+void tanhfv_fast(const float* x, int n, float* r);
+
+// make_unit with rsqrtf_fast, for either scalar type. The result has unit length to about 3e-7.
+template<class T>
+inline void make_unit_fast(T& vx, T& vy) {
+	float mag2 = (float) (vx * vx + vy * vy);
+	if (mag2 != 0.0f) {
+		T inv = (T) rsqrtf_fast(mag2);
+		vx *= inv;
+		vy *= inv;
+	}
+}
+
+#endif
@@ -6,11 +6,19 @@
 #include <iostream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <thread>
 
 #include "imatrix.h"
 #include "ETF.h"
 #include "fdog.h"
 #include "myvec.h"
+#include "threadpool.h"
+#include "cldcontext.h"
+#include "cldtile.h"
+#include "cldfile.h"
+#include "cldbatch.h"
+#include "fastmath.h"
 
 #define USE_VIDEO false
 #define SAVE_IMAGE false
@@ -18,14 +26,121 @@
 using namespace cv;
 using namespace std;
 
+// Resolution divisor for the ETF, set with --etf-scale
+int etfScale = 1;
+// Trace the flow DoG only where it can fall below 1, set with --sparse-flow
+bool sparseFlow = false;
+// Angles the DoG normals are snapped to, 0 for the exact normal, set with --dog-bins
+int dogBins = 0;
+// Isotropic XDoG edges instead of the flow-based DoG, set with --xdog
+bool xdog = false;
+// Structure tensor ETF instead of set2 and Smooth, set with --tensor-etf
+bool tensorETF = false;
+// Run the CLD chain tile by tile with CldTiler, set with --tiled
+bool tiled = false;
+// Raw 8-bit image to process out of core, set with --raw
+const char* rawInput = 0;
+const char* rawOutput = 0;
+int rawWidth = 0, rawHeight = 0;
+// Directory or list file and output directory of the headless batch mode, set with --batch
+const char* batchInput = 0;
+const char* batchOutput = 0;
+// Batch threads, set with --jobs, 0 for one per hardware thread
+int batchJobs = 0;
+// --threads was given
+bool threadsSet = false;
+
 void withVideo(CvCapture* capture);
-void withoutVideo(Mat& outputImage, Mat originalImage);
-void convertToMat(Mat& frame, imatrix img, int height, int width);
-void runCLDWork(imatrix& img);
+bool withoutVideo(Mat& outputImage, Mat originalImage, CldContext& context, CldTiler& tiler);
+int runBatch();
+void convertToMat(Mat& frame, imatrix& img, int height, int width);
+void runCLDWork(CldContext& context);
+bool runTiledCLDWork(CldTiler& tiler, Mat& grayFrame, Mat& lines);
 
-int main() {
+int main(int argc, char** argv) {
 	CvCapture* capture;
 
+	for (int i = 1; i < argc; i++) {
+		// --threads N sets how many threads the CLD stages use, defaults to one per hardware thread.
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			ThreadPool::setSharedThreads(atoi(argv[++i]));
+			threadsSet = true;
+		}
+		// --etf-scale 2|4 builds the tangent field at half or quarter resolution.
+		if (strcmp(argv[i], "--etf-scale") == 0 && i + 1 < argc) {
+			etfScale = atoi(argv[++i]);
+			if (!CldContext::isETFScale(etfScale)) {
+				cerr << "--etf-scale must be 1, 2 or 4, not " << argv[i] << endl;
+				return 1;
+			}
+		}
+		// --sparse-flow skips flow DoG pixels that cannot become edges, pays off on clean images.
+		if (strcmp(argv[i], "--sparse-flow") == 0) {
+			sparseFlow = true;
+		}
+		// --dog-bins N snaps the DoG normals to N angles and reads precomputed integer offsets, see
+		// DoGKernelBank. The lines move slightly; 0 keeps the exact normal. The tiled and raw modes
+		// always use the exact normal.
+		if (strcmp(argv[i], "--dog-bins") == 0 && i + 1 < argc) {
+			dogBins = atoi(argv[++i]);
+			if (dogBins < 0) {
+				cerr << "--dog-bins must be 0 or more, not " << argv[i] << endl;
+				return 1;
+			}
+		}
+		// --xdog swaps the FDoG for the cheaper isotropic XDoG, for previews and slow machines.
+		// The tiled and raw modes always use the FDoG.
+		if (strcmp(argv[i], "--xdog") == 0) {
+			xdog = true;
+		}
+		// --tensor-etf builds the tangent field from the smoothed structure tensor, see
+		// ETF_t::setTensor. Not used by the tiled and raw modes either.
+		if (strcmp(argv[i], "--tensor-etf") == 0) {
+			tensorETF = true;
+		}
+		// --fast-math uses the polynomial tanh and reciprocal square root of fastmath.h in the
+		// CLD loops, the lines move by at most a grey level here and there.
+		if (strcmp(argv[i], "--fast-math") == 0) {
+			SetFastMath(true);
+		}
+		// --tiled keeps only a tile's worth of the tangent field and DoG, for very large images.
+		// It has no temporal field, so video frames are processed independently.
+		if (strcmp(argv[i], "--tiled") == 0) {
+			tiled = true;
+		}
+		// --raw IN OUT WIDTH HEIGHT draws the lines of a headerless 8-bit grey image of any size
+		// without loading it, see RunCLDOnRawFile, and exits.
+		if (strcmp(argv[i], "--raw") == 0 && i + 4 < argc) {
+			rawInput = argv[++i];
+			rawOutput = argv[++i];
+			rawWidth = atoi(argv[++i]);
+			rawHeight = atoi(argv[++i]);
+		}
+		// --batch IN OUT draws the lines of every image in the directory or list file IN into the
+		// directory OUT without opening a window, see RunBatch, and exits.
+		if (strcmp(argv[i], "--batch") == 0 && i + 2 < argc) {
+			batchInput = argv[++i];
+			batchOutput = argv[++i];
+		}
+		// --jobs N processes N batch images at a time, defaults to one per hardware thread.
+		if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+			batchJobs = atoi(argv[++i]);
+		}
+	}
+
+	if (rawInput) {
+		CldTiler tiler;
+		if (!RunCLDOnRawFile(tiler, rawInput, rawOutput, rawHeight, rawWidth, 1.0, 3.0, 0.99, 0.7)) {
+			cerr << "Could not process " << rawInput << " into " << rawOutput << endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	if (batchInput) {
+		return runBatch();
+	}
+
 	// Read the video stream
 	capture = cvCaptureFromCAM(-1);
 
@@ -36,7 +151,12 @@ int main() {
 	} else {
 		Mat originalImage = imread("/home/student/Pictures/Webcam/test1.jpg");
 		Mat finalImage;
-		withoutVideo(finalImage, originalImage);
+		CldContext context;
+		CldTiler tiler;
+		if (!withoutVideo(finalImage, originalImage, context, tiler)) {
+			cerr << "The image needs at least 3 rows and 3 columns" << endl;
+			return 1;
+		}
 		imshow("Output Image", finalImage);
 		if (SAVE_IMAGE) {
 			imwrite("/home/student/Pictures/cartoon.jpg", finalImage);
@@ -49,16 +169,30 @@ int main() {
 
 void withVideo(CvCapture* capture) {
 	Mat originalFrame, grayFrame;
+	// one context for the whole stream, its buffers are only allocated for the first frame
+	CldContext context;
+	CldTiler tiler;
+	Mat lines;
+	context.setETFScale(etfScale);
+	// consecutive frames have nearly the same tangent field, start each one from the last
+	context.setTemporal(true);
 	while (true) {
 		// get the next video frame
 		originalFrame = cvQueryFrame(capture);
 		cvtColor(originalFrame, grayFrame, CV_RGB2GRAY);
-		imatrix img;
 
 		int height = originalFrame.rows;
 		int width = originalFrame.cols;
 
-		img.init(height, width);
+		if (tiled) {
+			if (runTiledCLDWork(tiler, grayFrame, lines))
+				imshow("Output Image", lines);
+			waitKey(10);
+			continue;
+		}
+
+		context.prepare(height, width);
+		imatrix& img = context.image;
 
 		// copy from dst (unsigned char) to img (int)
 		for (int y = 0; y < height; y++) {
@@ -67,7 +201,7 @@ void withVideo(CvCapture* capture) {
 			}
 		}
 
-		runCLDWork(img);
+		runCLDWork(context);
 
 		convertToMat(grayFrame, img, height, width);
 		imshow("Output Image", grayFrame);
@@ -76,15 +210,22 @@ void withVideo(CvCapture* capture) {
 	}
 }
 
-void withoutVideo(Mat& outputImage, Mat originalImage) {
+// Returns false, leaving outputImage alone, for images the CLD cannot take: under 3 rows or columns.
+bool withoutVideo(Mat& outputImage, Mat originalImage, CldContext& context, CldTiler& tiler) {
+	if (originalImage.rows < 3 || originalImage.cols < 3)
+		return false;
 	Mat grayFrame;
 	cvtColor(originalImage, grayFrame, CV_RGB2GRAY);
-	imatrix img;
+	if (tiled) {
+		return runTiledCLDWork(tiler, grayFrame, outputImage);
+	}
+	context.setETFScale(etfScale);
 
 	int height = originalImage.rows;
 	int width = originalImage.cols;
 
-	img.init(height, width);
+	context.prepare(height, width);
+	imatrix& img = context.image;
 
 	// copy from dst (unsigned char) to img (int)
 	for (int y = 0; y < height; y++) {
@@ -93,13 +234,49 @@ void withoutVideo(Mat& outputImage, Mat originalImage) {
 		}
 	}
 
-	runCLDWork(img);
+	runCLDWork(context);
 
 	convertToMat(grayFrame, img, height, width);
 	outputImage = grayFrame;
+	return true;
 }
 
-void convertToMat(Mat& frame, imatrix img, int height, int width) {
+// Batch worker for the line drawing, the context and tiler keep their buffers between images.
+class CldBatchWorker: public BatchWorker {
+private:
+	CldContext context;
+	CldTiler tiler;
+public:
+	bool process(const Mat& input, Mat& output) {
+		return withoutVideo(output, input, context, tiler);
+	}
+};
+
+int runBatch() {
+	vector<string> paths;
+	if (!ListBatchInputs(batchInput, paths)) {
+		cerr << "Could not read " << batchInput << endl;
+		return 1;
+	}
+	int jobs = batchJobs;
+	if (jobs < 1) {
+		jobs = (int) thread::hardware_concurrency();
+		if (jobs < 1)
+			jobs = 1;
+	}
+	// images run in parallel already, splitting each one into bands as well only adds contention
+	if (!threadsSet) {
+		ThreadPool::setSharedThreads(1);
+	}
+
+	vector<CldBatchWorker> workers(jobs);
+	vector<BatchWorker*> pointers;
+	for (int k = 0; k < jobs; k++)
+		pointers.push_back(&workers[k]);
+	return RunBatch(paths, batchOutput, pointers) ? 1 : 0;
+}
+
+void convertToMat(Mat& frame, imatrix& img, int height, int width) {
 	for (int y = 0; y < height; y++) {
 		for (int x = 0; x < width; x++) {
 			frame.at<unsigned char>(y, x) = img[y][x];
@@ -107,19 +284,30 @@ void convertToMat(Mat& frame, imatrix img, int height, int width) {
 	}
 }
 
-void runCLDWork(imatrix& img) {
-	// We assume that you have loaded your input image into an imatrix named "img"
-	int image_x = img.getRow();
-	int image_y = img.getCol();
-
-	ETF e;
-	e.init(image_x, image_y);
-	//e.set(img); // get gradients from input image
-	e.set2(img); // get gradients from gradient map
-	e.Smooth(4, 2);
+void runCLDWork(CldContext& context) {
+	// We assume that you have loaded your input image into context.image
+	// The context gets gradients from the gradient map (set2) and smooths them with Smooth(4, 2)
+	double tao = 0.99;
+	double thres = 0.7;
+	CldContext::Options options;
+	options.sparse = sparseFlow;
+	options.angle_bins = dogBins;
+	context.setEdgeMode(xdog ? CLD_EDGES_XDOG : CLD_EDGES_FDOG);
+	if (context.getETFMode() != (tensorETF ? CLD_ETF_TENSOR : CLD_ETF_SMOOTH))
+		context.setETFMode(tensorETF ? CLD_ETF_TENSOR : CLD_ETF_SMOOTH);
+	context.run(1.0, 3.0, tao, thres, options);
+}
 
+// Returns false and empties lines if the tiler refuses the frame.
+bool runTiledCLDWork(CldTiler& tiler, Mat& grayFrame, Mat& lines) {
+	// Same parameters as runCLDWork, the lines are written to a separate plane
 	double tao = 0.99;
 	double thres = 0.7;
-	GetFDoG(img, e, 1.0, 3.0, tao);
-	GrayThresholding(img, thres);
+	lines.create(grayFrame.rows, grayFrame.cols, CV_8UC1);
+	if (!tiler.run(grayFrame.data, (int) grayFrame.step, lines.data, (int) lines.step, grayFrame.rows, grayFrame.cols,
+			1.0, 3.0, tao, thres)) {
+		lines.release();
+		return false;
+	}
+	return true;
 }
@@ -3,30 +3,31 @@
 
 #include <cmath>
 
-class myvec {
+template<class T>
+class myvec_t {
 private:
 
 public:
 	int N;
-	double* p;
-	myvec() {
+	T* p;
+	myvec_t() {
 		N = 1;
-		p = new double[1];
+		p = new T[1];
 		p[0] = 1.0;
 	}
 	;
-	myvec(int i) {
+	myvec_t(int i) {
 		N = i;
-		p = new double[N];
+		p = new T[N];
 	}
 	;
-	~myvec() {
+	~myvec_t() {
 		delete[] p;
 	}
-	double& operator[](int i) {
+	T& operator[](int i) {
 		return p[i];
 	}
-	const double& operator[](int i) const {
+	const T& operator[](int i) const {
 		return p[i];
 	}
 	void zero() {
@@ -34,7 +35,7 @@ public:
 			p[i] = 0.0;
 	}
 	void make_unit() {
-		double sum = 0.0;
+		T sum = 0.0;
 		for (int i = 0; i < N; i++) {
 			sum += p[i] * p[i];
 		}
@@ -45,15 +46,15 @@ public:
 			}
 		}
 	}
-	double norm() {
-		double sum = 0.0;
+	T norm() {
+		T sum = 0.0;
 		for (int i = 0; i < N; i++) {
 			sum += p[i] * p[i];
 		}
 		sum = sqrt(sum);
 		return sum;
 	}
-	double get(int n) const {
+	T get(int n) const {
 		return p[n];
 	}
 	int getMax() {
@@ -62,54 +63,59 @@ public:
 	void init(int i) {
 		delete[] p;
 		N = i;
-		p = new double[N];
+		p = new T[N];
 	}
 };
 
-class mymatrix {
+// Vectors and matrices are templated on their scalar; the CLD pipeline runs in float, the double
+// instantiations are kept as the reference.
+typedef myvec_t<double> myvec;
+
+template<class T>
+class mymatrix_t {
 private:
 	int Nr, Nc;
-	double** p;
+	T** p;
 	void delete_all() {
 		for (int i = 0; i < Nr; i++)
 			delete[] p[i];
 		delete[] p;
 	}
 public:
-	mymatrix() {
+	mymatrix_t() {
 		Nr = 1, Nc = 1;
-		p = new double*[Nr];
+		p = new T*[Nr];
 		for (int i = 0; i < Nr; i++)
-			p[i] = new double[Nc];
+			p[i] = new T[Nc];
 		p[0][0] = 1.0;
 	}
 	;
-	mymatrix(int i, int j) {
+	mymatrix_t(int i, int j) {
 		Nr = i, Nc = j;
-		p = new double*[Nr];
+		p = new T*[Nr];
 		for (i = 0; i < Nr; i++)
-			p[i] = new double[Nc];
+			p[i] = new T[Nc];
 	}
 	;
-	mymatrix(mymatrix& b) {
+	mymatrix_t(mymatrix_t& b) {
 		Nr = b.Nr;
 		Nc = b.Nc;
-		p = new double*[Nr];
+		p = new T*[Nr];
 		for (int i = 0; i < Nr; i++) {
-			p[i] = new double[Nc];
+			p[i] = new T[Nc];
 			for (int j = 0; j < Nc; j++) {
 				p[i][j] = b[i][j];
 			}
 		}
 	}
-	~mymatrix() {
+	~mymatrix_t() {
 		delete_all();
 	}
-	double* operator[](int i) {
+	T* operator[](int i) {
 		return p[i];
 	}
 	;
-	double& get(int i, int j) const {
+	T& get(int i, int j) const {
 		return p[i][j];
 	}
 	int getRow() const {
@@ -121,9 +127,9 @@ public:
 	void init(int i, int j) {
 		delete_all();
 		Nr = i, Nc = j;
-		p = new double*[Nr];
+		p = new T*[Nr];
 		for (i = 0; i < Nr; i++)
-			p[i] = new double[Nc];
+			p[i] = new T[Nc];
 	}
 	;
 	void zero() {
@@ -133,4 +139,6 @@ public:
 	}
 };
 
+typedef mymatrix_t<double> mymatrix;
+
 #endif
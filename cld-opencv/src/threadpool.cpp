@@ -0,0 +1,142 @@
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(int threads) :
+		head(0), tail(0), stopping(false) {
+	for (int i = 1; i < threads; i++)
+		workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+}
+
+void ThreadPool::runBands(Job& job) {
+	int b;
+	while ((b = job.next.fetch_add(1)) < job.bands) {
+		int begin = b * job.band;
+		int end = (begin + job.band < job.count) ? begin + job.band : job.count;
+		try {
+			job.fn(job.ctx, begin, end);
+		} catch (...) {
+			std::unique_lock<std::mutex> guard(lock);
+			if (!job.error)
+				job.error = std::current_exception();
+			job.next = job.bands;
+		}
+	}
+}
+
+// Removes a job from the waiting list, the pool lock must be held.
+void ThreadPool::unlink(Job* job) {
+	Job* prev = 0;
+	for (Job* j = head; j; prev = j, j = j->link) {
+		if (j == job) {
+			if (prev)
+				prev->link = j->link;
+			else
+				head = j->link;
+			if (tail == j)
+				tail = prev;
+			return;
+		}
+	}
+}
+
+void ThreadPool::workerLoop() {
+	std::unique_lock<std::mutex> guard(lock);
+	while (true) {
+		while (!stopping && !head)
+			wake.wait(guard);
+		if (stopping)
+			return;
+
+		Job* job = head;
+		job->running++;
+		if (--job->wanted == 0)
+			unlink(job);
+
+		guard.unlock();
+		runBands(*job);
+		guard.lock();
+
+		if (--job->running == 0)
+			job->done.notify_all();
+	}
+}
+
+void ThreadPool::run(int count, int band, void (*fn)(const void*, int, int), const void* ctx) {
+	if (count <= 0)
+		return;
+	if (band < 1)
+		band = 1;
+
+	int bands = (count + band - 1) / band;
+	if (workers.empty() || bands == 1) {
+		for (int begin = 0; begin < count; begin += band)
+			fn(ctx, begin, (begin + band < count) ? begin + band : count);
+		return;
+	}
+
+	int wanted = ((int) workers.size() < bands - 1) ? (int) workers.size() : bands - 1;
+
+	Job job;
+	job.fn = fn;
+	job.ctx = ctx;
+	job.count = count;
+	job.band = band;
+	job.bands = bands;
+	job.next = 0;
+	job.wanted = wanted;
+	job.running = 0;
+	job.link = 0;
+
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		if (tail)
+			tail->link = &job;
+		else
+			head = &job;
+		tail = &job;
+	}
+	if (wanted == 1)
+		wake.notify_one();
+	else
+		wake.notify_all();
+
+	runBands(job);
+
+	// Every band has been claimed; stop further workers joining and wait for those still running.
+	std::unique_lock<std::mutex> guard(lock);
+	if (job.wanted > 0)
+		unlink(&job);
+	while (job.running > 0)
+		job.done.wait(guard);
+	guard.unlock();
+
+	if (job.error)
+		std::rethrow_exception(job.error);
+}
+
+static ThreadPool* sharedPool = 0;
+static std::mutex sharedLock;
+
+ThreadPool& ThreadPool::shared() {
+	std::unique_lock<std::mutex> guard(sharedLock);
+	if (!sharedPool) {
+		int threads = (int) std::thread::hardware_concurrency();
+		sharedPool = new ThreadPool(threads > 0 ? threads : 1);
+	}
+	return *sharedPool;
+}
+
+void ThreadPool::setSharedThreads(int threads) {
+	std::unique_lock<std::mutex> guard(sharedLock);
+	delete sharedPool;
+	sharedPool = new ThreadPool(threads > 0 ? threads : 1);
+}
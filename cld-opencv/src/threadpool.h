@@ -0,0 +1,86 @@
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads that run row-banded loops. A range is always cut into the same bands
+// for a given count and band size, whatever the number of threads, and each band is handed to
+// exactly one thread, so per-row results do not depend on the thread count. The calling thread works
+// on its own loop while it waits, which makes nested and concurrent parallelFor calls safe. Jobs
+// live on the caller's stack, so a parallelFor call does not allocate. An exception thrown by a band
+// stops the bands not yet started and is rethrown by parallelFor once the others have finished.
+class ThreadPool {
+private:
+	struct Job {
+		void (*fn)(const void*, int, int);
+		const void* ctx;
+		int count;
+		int band;
+		int bands;
+		std::atomic<int> next;
+		int wanted; // workers that may still join, guarded by the pool lock
+		int running; // workers inside runBands, guarded by the pool lock
+		Job* link;
+		std::condition_variable done;
+		std::exception_ptr error; // first exception of a band, guarded by the pool lock
+	};
+
+	std::vector<std::thread> workers;
+	Job* head;
+	Job* tail;
+	std::mutex lock;
+	std::condition_variable wake;
+	bool stopping;
+
+	void workerLoop();
+	void unlink(Job* job);
+	void run(int count, int band, void (*fn)(const void*, int, int), const void* ctx);
+	void runBands(Job& job);
+
+	template<class F>
+	static void invoke(const void* fn, int begin, int end) {
+		(*(const F*) fn)(begin, end);
+	}
+public:
+	explicit ThreadPool(int threads);
+	~ThreadPool();
+
+	int getThreads() const {
+		return (int) workers.size() + 1;
+	}
+
+	// Calls fn(begin, end) for consecutive bands of at most "band" items covering [0, count).
+	template<class F>
+	void parallelFor(int count, int band, const F& fn) {
+		run(count, band, &ThreadPool::invoke<F>, &fn);
+	}
+
+	// Runs a() and b() as two independent tasks and returns when both are done. The calling thread
+	// takes one and an idle worker the other; a worker that finishes early goes on to the bands of
+	// any parallelFor the other task makes, so a short and a long task still share the threads.
+	template<class A, class B>
+	void parallelInvoke(const A& a, const B& b) {
+		parallelFor(2, 1, [&](int begin, int end) {
+			for (int k = begin; k < end; k++) {
+				if (k == 0)
+					a();
+				else
+					b();
+			}
+		});
+	}
+
+	// Pool shared by the CLD stages. Defaults to one thread per hardware thread.
+	static ThreadPool& shared();
+	static void setSharedThreads(int threads);
+};
+
+// Rows per band used by the CLD stages.
+#define CLD_BAND_ROWS 16
+
+#endif